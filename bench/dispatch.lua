@@ -0,0 +1,60 @@
+-- Lua Extreme benchmark: interpreter dispatch loop
+-- See Agreement in LICENSE
+--
+-- how to run:
+  -- exlua bench/dispatch.lua [n] - run each loop n times (default 10000000)
+  -- compare millions of instructions per second with stock Lua 5.3 (loops use only standard functions).
+
+local n = tonumber(arg and arg[1]) or 10000000
+local clock = os.clock
+
+local function bench(name, f)
+  local best = math.huge
+  for i = 1, 3 do
+    local t = clock()
+    f(n)
+    t = clock() - t
+    if t < best then best = t end
+  end
+  print(string.format('%-10s %8.3f s %10.1f M iterations/s', name, best, n / best / 1e6))
+end
+
+bench('loop', function(n)
+  for i = 1, n do end
+end)
+
+bench('arith', function(n)
+  local x, y = 0, 1
+  for i = 1, n do
+    x = x + i * y - (i // 3)
+    y = y ~ 1
+  end
+  return x
+end)
+
+bench('while', function(n)
+  local i, x = 0, 0.5
+  while i < n do
+    i = i + 1
+    x = x * 0.999 + 0.001
+  end
+  return x
+end)
+
+bench('table', function(n)
+  local t = {0, 0, 0, 0}
+  for i = 1, n do
+    local k = (i & 3) + 1
+    t[k] = t[k] + 1
+  end
+  return t
+end)
+
+bench('call', function(n)
+  local function f(a, b) return a + b end
+  local x = 0
+  for i = 1, n do
+    x = f(x, i)
+  end
+  return x
+end)
@@ -3,12 +3,38 @@
 -- Copyright (C) 2019, Alexey Smirnov <saylermedia@gmail.com>
 --
 -- how to use:
-  -- serialize(...) - serialize arguments, return one argument (string)
+  -- serialize(...) - serialize arguments, return one argument (binary string)
   -- deserialize(s) - deserialize string, return arguments
+  -- serialize.records(list, fields) - serialize list of tables with same keys by columns, field names is written
+     -- once, columns of integers is packed as differences; return one argument (string) deserialized to list
+  -- serialize_to(out, ...) - serialize arguments to file or object with method send(s) (return count of sent bytes)
+     -- by blocks, large data is not kept in memory
+  -- deserialize_from(in) - deserialize values from file or object with method recv() (return block or nil at end)
+     -- until end of data, return values
+  -- serialize.save(path, ...) - serialize arguments to file path, return true or nil, error message and code;
+     -- file is replaced only by complete snapshot (written to temporary file in same directory, flushed and renamed)
+  -- serialize.load(path) - deserialize values from file path mapped to memory, data is read once without copies,
+     -- tables is created presized; return values or nil, error message and code
+
+  -- binary format: signature byte, then type tag byte of each value with payload:
+  -- integers is zigzag varints, floats is raw numbers (native byte order), strings is varint length and raw bytes,
+  -- tables and functions is referenced once serialized. text format of previous versions is still deserialized.
   
   -- in 'C':
   -- void lua_serialize (lua_State *L, int idx, int lastidx) - serialize values from idx to lastidx and push string
   -- int lua_deserialize (lua_State *L, int idx) - deserialize string to values (push) and return count
+  -- void lua_serializeto (lua_State *L, int idx, int lastidx, lua_Writer writer, void *ud) - serialize values
+     -- from idx to lastidx by blocks to writer
+  -- int lua_deserializefrom (lua_State *L, lua_Reader reader, void *ud) - deserialize values from blocks of reader
+     -- (push) and return count
+  -- int lua_deserializebuffer (lua_State *L, const char *s, size_t l) - deserialize values from memory s of size l
+     -- (push) and return count
+  -- void lua_serializerecords (lua_State *L, int idx, int fields) - serialize list idx as records with field names
+     -- of list fields and push string
+  -- void lua_setserializer (lua_State *L, const char *tname, lua_Serializer s, lua_Deserializer d) - register
+     -- native serializer of userdata with metatable tname: s(L, idx, buf, size) copies data to buf if size is enough
+     -- and returns size of data, d(L, data, size) pushes new userdata; data is copied as is (native byte order)
+     -- without calls of __serialize and __deserialize. decimal, byte and re objects is serialized so
 
   -- In metatable of userdata, declare functions:
   -- __serialize - convert userdata object to serialized value (must be return one result)
@@ -16,16 +42,20 @@
 
 
 local function ser(v)
-  print(type(v), v, serialize(v), deserialize(serialize(v)))
+  print(type(v), v, #serialize(v), deserialize(serialize(v)))
 end
 
-print('type', 'value', 'serialized', 'deserialized')
+print('type', 'value', 'size', 'deserialized')
 ser(nil)
 ser(true)
 ser(false)
 ser(100500)
 ser(17384.8751)
 ser('Hello World!')
+ser(math.pi)
+ser(math.mininteger)
+print('exact:', deserialize(serialize(0.1)) == 0.1, math.type(deserialize(serialize(2.0))))
+print('text format:', deserialize('{I100500}{SEIGFGMGMGPCAFHGPHCGMGECB}'))
 
 print()
 print('Serialize function:')
@@ -69,7 +99,74 @@ for i = 1, 1000 do
 end
 
 local s = serialize(tt)
-print(s, #s)
+print('1000 integers:', #s)
+local t = {}
+t.self = t
+local d = deserialize(serialize(t))
+print('cycle:', d.self == d)
+local deep = {}
+for i = 1, 5000 do
+  deep = {deep}
+end
+d = deserialize(serialize(deep))
+local depth = 0
+while d[1] do
+  d = d[1]
+  depth = depth + 1
+end
+print('depth:', depth)
+
+print()
+print('Serialize records:')
+local records = {}
+for i = 1, 1000 do
+  records[i] = {id = i, ts = 1500000000 + i * 10, value = i / 4}
+end
+local rs = serialize.records(records, {'id', 'ts', 'value'})
+local list = deserialize(rs)
+print(#serialize(records), #rs, #list, list[10].id, list[10].ts, list[10].value)
+
+print()
+print('Serialize native userdata:')
+local nd, nb, nr = deserialize(serialize(decimal('12345678901234567890.0123456789'), byte.alloc('\1\2\3'), re.compile('(\\d+)-(\\d+)')))
+print(nd, #nb, nr:exec('10-20'))
+
+print()
+print('Serialize to file:')
+local name = os.tmpname()
+local f = io.open(name, 'wb')
+serialize_to(f, tt, 'end')
+f:close()
+f = io.open(name, 'rb')
+local tail
+list, tail = deserialize_from(f)
+f:close()
+os.remove(name)
+print(#list, list[1000], tail)
+
+print('Save and load snapshot:')
+name = os.tmpname()
+print(serialize.save(name, records, 'end'))
+list, tail = serialize.load(name)
+print(#list, list[1000].ts, tail)
+print(pcall(serialize.save, name, records, coroutine.create(print)))
+list, tail = serialize.load(name)  -- failed save keeps previous snapshot
+os.remove(name)
+print(#list, list[1000].ts, tail)
+
+print('Serialize by blocks:')
+local blocks = {}
+serialize_to({send = function(self, s)
+  local n = math.min(#s, 100)
+  table.insert(blocks, s:sub(1, n))
+  return n
+end}, tt, vec)
+local i = 0
+list, svec = deserialize_from({recv = function(self)
+  i = i + 1
+  return blocks[i]
+end})
+print(#blocks, #list, svec.v)
 
 print('success')
 
@@ -3,6 +3,30 @@
 -- Copyright (C) 2019, Alexey Smirnov <saylermedia@gmail.com>
 --
 -- how to use:
+  -- socket.tcp() - create TCP socket
+  -- socket.udp() - create UDP socket
+  -- methods:
+    -- setblocking(b), connect(addr, port), select(seconds), recvtimeo(seconds), sendtimeo(seconds)
+    -- reuseaddr([b]), reuseport([b]) - set SO_REUSEADDR, SO_REUSEPORT (listeners of every thread can be bound
+       -- to same port, connections is balanced by system)
+    -- bind(addr, port) - addr '*' is any address, port 0 is any port
+    -- listen([backlog]) - backlog is SOMAXCONN by default
+    -- accept([max]) - return up to max accepted sockets of non-blocking socket (in one call), one of blocking
+       -- socket; accepted socket is non-blocking as listener; nothing if no connection yet, nil and message on error
+    -- addr() - return local address and port
+    -- recv([size]) - return data, nil if connection is closed (or on error, timeout of blocking socket) or false if
+       -- non-blocking socket has no data yet
+    -- send(s) - return count of sent bytes
+    -- recvfrom([size]) - return data, address and port of sender (UDP), nil or false as recv
+    -- sendto(s, addr, port) - return count of sent bytes (UDP)
+    -- close()
+  -- socket.poller([maxevents]) - create poller of socket events (epoll, Linux)
+  -- methods:
+    -- add(sock, events), mod(sock, events), del(sock) - events is string of r (read), w (write),
+       -- e (edge triggered), o (one shot); socket is kept by poller until del or close of socket
+    -- wait([timeout_ms]) - wait events (forever by default), return table of ready sockets with events
+       -- r (read), w (write), h (hang up or error)
+    -- close()
 
 local ifr = socket.ifr()
 for k, v in pairs(ifr) do
@@ -18,3 +42,106 @@ local s = socket.tcp()
 --print(s:recv())
 --s:close()
 print('closed')
+
+-- coroutines wait readiness of non-blocking sockets
+local poller = socket.poller()
+local waiting = {}
+
+local function await(sock, events)
+  waiting[sock] = coroutine.running()
+  poller:add(sock, events)
+  local ready = coroutine.yield()
+  poller:del(sock)
+  waiting[sock] = nil
+  return ready
+end
+
+local co = coroutine.wrap(function()
+  local c = socket.tcp()
+  c:setblocking(false)
+  c:connect('127.0.0.1', 1)  -- nobody listens
+  print('connect:', await(c, 'w'))
+  c:close()
+end)
+co()
+
+while next(waiting) do
+  for sock, events in pairs(poller:wait(1000)) do
+    coroutine.resume(waiting[sock], events)
+  end
+end
+poller:close()
+
+-- echo server: two listeners of one port (as in two threads), non-blocking accept by batches
+local l1 = socket.tcp()
+l1:reuseaddr()
+l1:reuseport()
+l1:bind('127.0.0.1', 0)
+local addr, port = l1:addr()
+local l2 = socket.tcp()
+l2:reuseaddr()
+l2:reuseport()
+print('reuseport:', l2:bind(addr, port))
+local listeners = {}
+for _, l in ipairs({l1, l2}) do
+  l:listen()
+  l:setblocking(false)
+  listeners[l] = true
+end
+poller = socket.poller()
+poller:add(l1, 'r')
+poller:add(l2, 'r')
+
+local clients = {}
+for i = 1, 5 do
+  local c = socket.tcp()
+  c:connect(addr, port)
+  c:send('hello ' .. i)
+  clients[i] = c
+end
+
+local echoed = 0
+while echoed < #clients do
+  for sock, events in pairs(poller:wait(1000)) do
+    if listeners[sock] then
+      for _, c in ipairs({sock:accept(64)}) do
+        poller:add(c, 'r')
+      end
+    else
+      local data = sock:recv()
+      if data then
+        sock:send(data)
+        echoed = echoed + 1
+      end
+      poller:del(sock)
+      sock:close()
+    end
+  end
+end
+for i, c in ipairs(clients) do
+  print('echo:', c:recv())
+  c:close()
+end
+poller:close()
+l1:close()
+print('accept error:', l1:accept())
+l2:close()
+
+-- UDP
+local u1, u2 = socket.udp(), socket.udp()
+u1:bind('127.0.0.1', 0)
+u2:sendto('ping', u1:addr())
+local data = u1:recvfrom()
+print('udp:', data)
+u1:recvtimeo(0.01)
+print('timeout:', u1:recv())
+u1:setblocking(false)
+print('no data:', u1:recv())
+
+-- closed socket is forgotten by poller (its descriptor can be reused)
+poller = socket.poller()
+poller:add(u1, 'w')
+u1:close()
+u2:close()
+print('forgotten:', next(debug.getuservalue(poller)), next(poller:wait(0)))
+poller:close()
@@ -4,22 +4,77 @@
 --
 -- how to use:
   -- thread(f, ...) - call function f(...) in new thread, return thread object
+  -- thread{f, ...; cpu = n or {n, ...}, stack = size, priority = -2..2, name = 'name'} - call f(...) in new thread
+     -- with CPU affinity, stack size in bytes, priority and name (affinity, priority and name is supported on linux)
   -- thread.join(t) - join thread, return status (true or false) and results (if status true) or error (if status false)
   -- thread.cancel(t) - cancel execution
+  -- thread.ready(t) - thread is completed, results can be joined without blocking
+  -- thread.wait(t[, timeout]) - wait until thread is completed (timeout in milliseconds), return true if completed
+  -- thread.wait_any(list[, timeout]) - wait until any thread in list is completed, return index and thread object
+  -- thread.wait_all(list[, timeout]) - wait until all threads in list are completed, return true if completed
   -- thread.running(t) - thread is running
   -- thread.interrupt() - set interrupted flag to true
   -- thread.interrupted([t]) - flag is interrupted
   -- thread.id([t]) - get current thread id
   -- thread.time() - get current time in milliseconds
   -- thread.sleep(time) - pause in milliseconds
-  -- thread.pool() - create thread pool, return pool object
-    -- :add(f, ...) - call function f(...) in new thread and store to pool, return thread object
+  -- thread.pool([n]) - create thread pool with n workers (default number of processors), return pool object
+  -- thread.pool{[n]; cpu =, stack =, priority =, name =} - create thread pool with workers attributes,
+     -- workers is pinned to listed CPUs in turn and named with number suffix
+  -- thread.pool{[n]; queue = size, policy = 'block' or 'fail' or 'caller', keep = boolean} - create thread pool
+     -- with bounded queue: when queue is full add waits (block), returns nil and error message (fail) or executes
+     -- task in calling thread (caller); handles of finished tasks is dropped from pool unless keep is true
+     -- (default keep is true for unbounded queue)
+    -- :add(f, ...) - queue call function f(...) to pool workers, return thread object
     -- :wait() - wait until all threads are completed
     -- :interrupt() - set interrupted flag to true for all threads
     -- :cancel() - cancel execution for all threads
+    -- collected pool completes queued and executing tasks before its workers stop (cancel them to drop),
+       -- timers of collected pool are stopped
+    -- :stats() - statistics: {workers, queued, running, completed, bytesin, bytesout (serialized tasks and results),
+       -- wait = {count, p50, p90, p99} (queue wait in milliseconds), run = {count, p50, p90, p99} (run time),
+       -- busy = {milliseconds of each worker}}
+    -- :after(ms, f, ...) - queue call function f(...) after ms milliseconds, return timer object
+    -- :every(ms, f, ...) - queue call function f(...) every ms milliseconds (missed calls is skipped), return timer object
+      -- timer:cancel() - stop timer, return true if calls was scheduled
+      -- timer:count() - number of queued calls
+  -- thread.channel([capacity]) - create bounded channel (default capacity 1024, rounded up to power of 2)
+    -- :push(...) - push message of values, wait while channel is full
+    -- :trypush(...) - push message without waiting, return false if channel is full
+    -- :pop([timeout]) - pop message values, wait while channel is empty (timeout in milliseconds)
+    -- :trypop() - pop message values without waiting, return nothing if channel is empty
+    -- #channel - number of queued messages
+  -- thread.shared([name]) - get shared table by name (or create new), return shared table object
+    -- :get(key), shared[key] - get copy of value
+    -- :set(key, value), shared[key] = value - set copy of value (nil removes key)
+    -- :cas(key, old, new) - set new value if current value is equal to old, return true if set
+    -- :incr(key[, n]) - add n (default 1) to integer value (missing is 0), return new value
+    -- #shared - number of keys
+    -- float keys with integer value is integer keys (as in tables), NaN is not a key
+  -- thread.template([f, ...]) - create template of states initialized by call f(...) once per state, return template object
+    -- :new(f, ...) - call function f(...) in new thread with ready state of template, return thread object
+    -- :warm([n]) - create ready states until n (default number of processors)
+    -- #template - number of ready states
+  -- thread.map(f, list[, options]) - return list of f(v) for values of list, calculated by pool in chunks
+  -- thread.foreach(f, list[, options]) - call f(v) for values of list by pool in chunks
+  -- thread.reduce(f, init, list[, options]) - return f(...f(f(init, v1), v2)...), f must be associative
+    -- options: {pool = pool, chunk = size}, default is pool of current worker or own pool and 4 chunks per worker
+  -- thread.async(f, ...) - in coroutine: queue call f(...) to pool and suspend coroutine until task is completed,
+     -- return results as join
+  -- thread.dispatch([timeout]) - resume coroutines of completed async tasks (wait timeout in milliseconds, default 0,
+     -- negative is infinite), return number of resumed and pending coroutines
+  -- thread.eventfd() - descriptor readable while async tasks are completed (to watch by event loop) or nil
+  -- template = tpl attribute of thread{...} and thread.pool{...} - take states of threads and workers from template
 
-  -- join, running, interrupt, interrupted, id is thread object methods.
+  -- join, ready, wait, running, interrupt, interrupted, id is thread object methods.
   -- in called function to all arguments or local variables is serialized copies.
+  -- pool workers keep own state between tasks, global variables is not reset.
+  -- pool object can be passed to task: subtasks is queued to worker of task and stolen by idle workers,
+  -- joining subtask in worker executes other queued tasks while waiting.
+  -- channel object can be passed to threads, messages is serialized copies.
+  -- passed channel, pool, shared table or template exists until received, even if sender object is collected.
+  -- shared table object can be passed to threads, named table exists while any object of it is referenced.
+  -- template states is created ahead, used state is replaced by finished thread.
 
   
 local time = thread.time()
@@ -48,6 +103,18 @@ print('results:')
 print('status', 'c', 'b', 'a')
 print(t:join())
 
+print()
+print('thread with attributes:')
+print(thread{function(x) return x * 2 end, 21; cpu = 0, stack = 1 << 20, name = 'double'}:join())
+
+print()
+print('thread with state of template:')
+local template = thread.template(function(greeting)
+  hello = function(name) return greeting .. ', ' .. name end
+end, 'Hello')
+template:warm(2)
+print(template:new(function() return hello('template') end):join())
+
 print()
 print('calculating factorial:')
 
@@ -67,6 +134,8 @@ end
 
 print('wait until all threads are completed') 
 pool:wait()
+local stats = pool:stats()
+print('completed', stats.completed, 'run time p99 <= ' .. stats.run.p99 .. ' ms')
 
 print('result:')
 print('value', 'id', 'status', 'result')
@@ -74,6 +143,138 @@ for i = 1, #pool do
   print(i, pool[i]:id(), pool[i]:join())
 end
 
+print()
+print('results in order of completion:')
+
+local sleepers = thread.pool(3)
+local list = {}
+for i, d in ipairs({150, 50, 100}) do
+  list[i] = sleepers:add(function(d) thread.sleep(d) return d end, d)
+end
+
+while #list > 0 do
+  local i, t = thread.wait_any(list)
+  print('sleep', select(2, t:join()))
+  table.remove(list, i)
+end
+
+print()
+print('bounded queue:')
+local bounded = thread.pool{1, queue = 1, policy = 'fail'}
+for i = 1, 5 do
+  local t, err = bounded:add(function() thread.sleep(20) end)
+  if not t then
+    print('add ' .. i .. ':', err)
+    break
+  end
+end
+bounded:wait()
+
+print()
+print('calculating fibonacci with subtasks:')
+
+local function pfib(pool, x)
+  if x < 10 then
+    return (x < 2) and x or pfib(pool, x - 1) + pfib(pool, x - 2)
+  end
+  local t = pool:add(pfib, pool, x - 1)
+  local b = pfib(pool, x - 2)
+  local status, a = t:join()
+  return a + b
+end
+
+print('fib(20) =', select(2, pool:add(pfib, pool, 20):join()))
+
+print()
+print('map and reduce:')
+local squares = thread.map(function(x) return x * x end, {1, 2, 3, 4, 5, 6, 7, 8}, {chunk = 3})
+print('squares:', table.concat(squares, ' '))
+print('sum:', thread.reduce(function(a, b) return a + b end, 0, squares, {pool = pool}))
+local odds = thread.map(function(v) if v % 2 == 0 then return nil end return v end, {1, 2, 3, 4, 5, 6, 7, 8, 9, 10}, {chunk = 3})
+local s = {}
+for i = 1, 10 do s[i] = tostring(odds[i]) end
+print('odds:', table.concat(s, ' '))
+
+print()
+print('async tasks in coroutines:')
+for i = 1, 3 do
+  coroutine.wrap(function()
+    local ok, square = thread.async(function(x) return x * x end, i)
+    print('coroutine ' .. i .. ' resumed:', square)
+  end)()
+end
+local resumed, pending
+repeat
+  resumed, pending = thread.dispatch(-1)
+until pending == 0
+
+print()
+print('producer and consumers with channel:')
+
+local jobs = thread.channel(16)
+local sums = thread.channel()
+for i = 1, 3 do
+  pool:add(function(jobs, sums)
+    local sum = 0
+    local x = jobs:pop()
+    while x do
+      sum = sum + x
+      x = jobs:pop()
+    end
+    sums:push(sum)
+  end, jobs, sums)
+end
+for x = 1, 1000 do
+  jobs:push(x)
+end
+for i = 1, 3 do
+  jobs:push(nil)
+end
+local sum = 0
+for i = 1, 3 do
+  sum = sum + sums:pop()
+end
+print('sum(1..1000) =', sum)
+print('empty:', #jobs, sums:pop(10))
+
+local inbox = thread.channel()
+inbox:push(thread.channel())  -- pushed channel object is not referenced
+collectgarbage()
+local reply = inbox:pop()
+reply:push('alive')
+print('passed channel:', reply:pop())
+
+print()
+print('timers:')
+local ticks = thread.channel()
+local once = pool:after(30, function(ch) ch:push('after') end, ticks)
+local every = pool:every(10, function(ch) ch:push('every') end, ticks)
+repeat until ticks:pop() == 'after'
+print('cancel:', every:cancel(), once:cancel(), once:count(), every:count() > 0)
+
+print()
+print('shared counters:')
+
+local shared = thread.shared('words')
+shared.list = {'one', 'two', 'three'}
+for i = 1, 6 do
+  pool:add(function()
+    local words = thread.shared('words')
+    local list = words.list
+    for j = 1, 100 do
+      words:incr(list[j % #list + 1])
+    end
+  end)
+end
+pool:wait()
+print('one', 'two', 'three', '#')
+print(shared.one, shared.two, shared.three, #shared)
+print('cas:', shared:cas('one', 100, 0), shared:cas('one', 198, 0), shared.one)
+shared[1] = 'first'
+print('number keys:', shared[1.0], pcall(shared.get, shared, 0/0))
+shared[1.0] = nil
+print('bad key:', pcall(shared.set, shared, coroutine.create(print), 'value'))
+
 print()
 print('elapsed ' .. (thread.time() - time) .. ' milliseconds')
 
@@ -87,3 +288,28 @@ local t = thread(loop)
 thread.sleep(500)
 t:cancel()
 print('cancel:', t:join())
+
+-- busy loop with own debug hook (kept by cancel)
+t = thread(function()
+  local lines = 0
+  debug.sethook(function() lines = lines + 1 end, 'l')
+  while true do end
+end)
+thread.sleep(100)
+t:cancel()
+print('cancel busy:', t:join())
+
+-- tasks of collected pool are completed
+local h = {}
+do
+  local p = thread.pool(1)
+  for i = 1, 10 do
+    h[i] = p:add(function(i) thread.sleep(5) return i end, i)
+  end
+end
+collectgarbage()
+local joined = {}
+for i = 1, 10 do
+  joined[i] = select(2, h[i]:join())
+end
+print('dropped pool:', table.concat(joined, ' '))
@@ -20,6 +20,19 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#if defined(LUAEX_SERIALIZE)
+#include <errno.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <io.h>
+#include <windows.h>
+#endif
+#endif
+
 
 static int luaB_print (lua_State *L) {
   int n = lua_gettop(L);  /* number of arguments */
@@ -462,10 +475,326 @@ static int luaB_serialize (lua_State *L) {
 }
 
 
+/* serialize(...) by call of table serialize */
+static int luaB_serializecall (lua_State *L) {
+  lua_remove(L, 1);
+  return luaB_serialize(L);
+}
+
+
+static int luaB_records (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_serializerecords(L, 1, 2);
+  return 1;
+}
+
+
 static int luaB_deserialize (lua_State *L) {
   luaL_checkany(L, 1);
   return lua_deserialize(L, 1);
 }
+
+
+/* object at index 1 has method name */
+static int hasmethod (lua_State *L, const char *name) {
+  int t = lua_type(L, 1);
+  if (t != LUA_TTABLE && t != LUA_TUSERDATA)
+    return 0;
+  t = lua_getfield(L, 1, name);
+  lua_pop(L, 1);
+  return t != LUA_TNIL;
+}
+
+
+static int filewriter (lua_State *L, const void *p, size_t sz, void *ud) {
+  (void) L;
+  return fwrite(p, 1, sz, (FILE *) ud) != sz;
+}
+
+
+/* write block by method send of object at index 1 */
+static int sendwriter (lua_State *L, const void *p, size_t sz, void *ud) {
+  const char *s = (const char *) p;
+  (void) ud;
+  while (sz > 0) {
+    lua_getfield(L, 1, "send");
+    lua_pushvalue(L, 1);
+    lua_pushlstring(L, s, sz);
+    lua_call(L, 2, 1);
+    lua_Integer n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (n <= 0 || (size_t) n > sz)
+      return 1;
+    s += n;
+    sz -= (size_t) n;
+  }
+  return 0;
+}
+
+
+static int luaB_serializeto (lua_State *L) {
+  luaL_checkany(L, 2);
+  luaL_Stream *p = (luaL_Stream *) luaL_testudata(L, 1, LUA_FILEHANDLE);
+  if (p) {
+    luaL_argcheck(L, p->closef != NULL, 1, "attempt to use a closed file");
+    lua_serializeto(L, 2, lua_gettop(L), filewriter, p->f);
+  } else {
+    luaL_argcheck(L, hasmethod(L, "send"), 1, "file or object with method send expected");
+    lua_serializeto(L, 2, lua_gettop(L), sendwriter, NULL);
+  }
+  return 0;
+}
+
+
+typedef struct FileReader {
+  FILE *f;
+  char buff[BUFSIZ];
+} FileReader;
+
+
+static const char *filereader (lua_State *L, void *ud, size_t *size) {
+  FileReader *r = (FileReader *) ud;
+  (void) L;
+  *size = fread(r->buff, 1, sizeof(r->buff), r->f);
+  return (*size > 0) ? r->buff : NULL;
+}
+
+
+/* read block by method recv of object at index 1, keep it at index 2 */
+static const char *recvreader (lua_State *L, void *ud, size_t *size) {
+  (void) ud;
+  lua_getfield(L, 1, "recv");
+  lua_pushvalue(L, 1);
+  lua_call(L, 1, 1);
+  lua_replace(L, 2);
+  return lua_tolstring(L, 2, size);
+}
+
+
+static int luaB_deserializefrom (lua_State *L) {
+  luaL_Stream *p = (luaL_Stream *) luaL_testudata(L, 1, LUA_FILEHANDLE);
+  lua_settop(L, 1);
+  if (p) {
+    luaL_argcheck(L, p->closef != NULL, 1, "attempt to use a closed file");
+    FileReader *r = (FileReader *) lua_newuserdata(L, sizeof(FileReader));
+    r->f = p->f;
+    return lua_deserializefrom(L, filereader, r);
+  }
+  luaL_argcheck(L, hasmethod(L, "recv"), 1, "file or object with method recv expected");
+  lua_pushnil(L);  /* slot of last block */
+  return lua_deserializefrom(L, recvreader, NULL);
+}
+
+
+/*
+** snapshot file is closed and unmapped (temporary file of save is
+** removed) when it is collected on error
+*/
+typedef struct Snapshot {
+  FILE *f;
+  void *addr;
+  size_t size;
+  const char *tmp;  /* temporary file name (uservalue) until it is renamed */
+} Snapshot;
+
+
+static void snapshot_close (Snapshot *sn) {
+  if (sn->f) {
+    fclose(sn->f);
+    sn->f = NULL;
+  }
+  if (sn->tmp) {
+    int en = errno;  /* keep error of failed save */
+    remove(sn->tmp);
+    sn->tmp = NULL;
+    errno = en;
+  }
+#ifndef _WIN32
+  if (sn->addr) {
+    munmap(sn->addr, sn->size);
+    sn->addr = NULL;
+  }
+#endif
+}
+
+
+static int snapshot_gc (lua_State *L) {
+  snapshot_close((Snapshot *) lua_touserdata(L, 1));
+  return 0;
+}
+
+
+static Snapshot *newsnapshot (lua_State *L) {
+  Snapshot *sn = (Snapshot *) lua_newuserdata(L, sizeof(Snapshot));
+  sn->f = NULL;
+  sn->addr = NULL;
+  sn->size = 0;
+  sn->tmp = NULL;
+  if (luaL_newmetatable(L, "SNAPSHOT*")) {
+    lua_pushcfunction(L, snapshot_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  return sn;
+}
+
+
+/* create temporary file of snapshot at index -1 for path */
+static int opentemp (lua_State *L, Snapshot *sn, const char *path) {
+  /* name is unique for live snapshots of process */
+#ifndef _WIN32
+  sn->tmp = lua_pushfstring(L, "%s.%d.%p.tmp", path, (int) getpid(), (void *) sn);
+#else
+  sn->tmp = lua_pushfstring(L, "%s.%d.%p.tmp", path, (int) GetCurrentProcessId(), (void *) sn);
+#endif
+  lua_setuservalue(L, -2);
+#ifndef _WIN32
+  struct stat st;
+  int fd = open(sn->tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0 && errno == EEXIST && unlink(sn->tmp) == 0)  /* left by crash */
+    fd = open(sn->tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    sn->tmp = NULL;
+    return 0;
+  }
+  if (stat(path, &st) == 0)  /* keep mode of replaced file */
+    fchmod(fd, st.st_mode & 07777);
+  sn->f = fdopen(fd, "wb");
+  if (sn->f == NULL)
+    close(fd);
+#else
+  sn->f = fopen(sn->tmp, "wb");
+#endif
+  return sn->f != NULL;
+}
+
+
+/* flush temporary file to disk, then replace path by it */
+static int committemp (lua_State *L, Snapshot *sn, const char *path) {
+  int ok = (fflush(sn->f) == 0);
+#ifndef _WIN32
+  ok = ok && fsync(fileno(sn->f)) == 0;
+#else
+  ok = ok && _commit(_fileno(sn->f)) == 0;
+#endif
+  ok = (fclose(sn->f) == 0) && ok;
+  sn->f = NULL;
+#ifndef _WIN32
+  if (!ok || rename(sn->tmp, path) != 0)
+    return 0;
+  sn->tmp = NULL;
+  /* make rename durable */
+  const char *sep = strrchr(path, '/');
+  if (sep == NULL)
+    lua_pushliteral(L, ".");
+  else
+    lua_pushlstring(L, path, (sep == path) ? 1 : (size_t) (sep - path));
+  int fd = open(lua_tostring(L, -1), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  lua_pop(L, 1);
+#else
+  (void) L;
+  if (!ok || !MoveFileExA(sn->tmp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+    if (ok)
+      errno = EACCES;
+    return 0;
+  }
+  sn->tmp = NULL;
+#endif
+  return 1;
+}
+
+
+/* write values of snapshot at index 1 (protected to remove temporary file on error) */
+static int savevalues (lua_State *L) {
+  Snapshot *sn = (Snapshot *) lua_touserdata(L, 1);
+  lua_serializeto(L, 2, lua_gettop(L), filewriter, sn->f);
+  return 0;
+}
+
+
+/*
+** Snapshot is written to temporary file in same directory which replaces
+** file of path only when it is complete and flushed to disk, so crash or
+** error never leaves truncated snapshot
+*/
+static int luaB_savesnapshot (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  luaL_checkany(L, 2);
+  int top = lua_gettop(L);
+  Snapshot *sn = newsnapshot(L);
+  if (!opentemp(L, sn, path))
+    return luaL_fileresult(L, 0, path);
+  int i;
+  luaL_checkstack(L, top + 1, "too many values");
+  lua_pushcfunction(L, savevalues);
+  lua_pushvalue(L, top + 1);
+  for (i = 2; i <= top; i++)
+    lua_pushvalue(L, i);
+  if (lua_pcall(L, top, 0, 0) != LUA_OK) {
+    snapshot_close(sn);  /* remove temporary file now */
+    return lua_error(L);
+  }
+  int ok = committemp(L, sn, path);
+  if (!ok)
+    snapshot_close(sn);  /* remove temporary file */
+  return luaL_fileresult(L, ok, path);
+}
+
+
+static int luaB_loadsnapshot (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  lua_settop(L, 1);
+  Snapshot *sn = newsnapshot(L);
+  int nresults;
+#ifndef _WIN32
+  /* deserialize from mapped file without copies */
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return luaL_fileresult(L, 0, path);
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return luaL_fileresult(L, 0, path);
+  }
+  if (st.st_size > 0) {
+    void *addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      close(fd);
+      return luaL_fileresult(L, 0, path);
+    }
+    sn->addr = addr;
+    sn->size = (size_t) st.st_size;
+    /* read ahead whole file */
+    posix_madvise(sn->addr, sn->size, POSIX_MADV_WILLNEED);
+    posix_madvise(sn->addr, sn->size, POSIX_MADV_SEQUENTIAL);
+  }
+  close(fd);
+  nresults = lua_deserializebuffer(L, (const char *) sn->addr, sn->size);
+#else
+  sn->f = fopen(path, "rb");
+  if (sn->f == NULL)
+    return luaL_fileresult(L, 0, path);
+  FileReader *r = (FileReader *) lua_newuserdata(L, sizeof(FileReader));
+  r->f = sn->f;
+  nresults = lua_deserializefrom(L, filereader, r);
+  lua_remove(L, 3);
+#endif
+  snapshot_close(sn);
+  return nresults;
+}
+
+
+static const luaL_Reg serialize_funcs[] = {
+  {"records", luaB_records},
+  {"save", luaB_savesnapshot},
+  {"load", luaB_loadsnapshot},
+  {NULL, NULL}
+};
 #endif
 
 
@@ -496,8 +825,9 @@ static const luaL_Reg base_funcs[] = {
   {"type", luaB_type},
   {"xpcall", luaB_xpcall},
 #ifdef LUAEX_SERIALIZE
-  {"serialize", luaB_serialize},
   {"deserialize", luaB_deserialize},
+  {"serialize_to", luaB_serializeto},
+  {"deserialize_from", luaB_deserializefrom},
 #endif
   /* placeholders */
   {"_G", NULL},
@@ -516,6 +846,15 @@ LUAMOD_API int luaopen_base (lua_State *L) {
   /* set global _VERSION */
   lua_pushliteral(L, LUA_VERSION);
   lua_setfield(L, -2, "_VERSION");
+#ifdef LUAEX_SERIALIZE
+  /* set global serialize as callable table of functions */
+  luaL_newlib(L, serialize_funcs);
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, luaB_serializecall);
+  lua_setfield(L, -2, "__call");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, -2, "serialize");
+#endif
   return 1;
 }
 
@@ -42,6 +42,7 @@ static int byte_alloc (lua_State *L) {
       luaL_error(L, _("not enough memory"));
   } else if (lua_type(L, 1) == LUA_TSTRING) {
     const char *s = lua_tolstring(L, 1, &l);
+    byte->data = NULL;
     if (l > 0) {
       byte->data = (unsigned char *) malloc(l);
       if (byte->data)
@@ -197,6 +198,32 @@ static const luaL_Reg byte_methods[] = {
 };
 
 
+#ifdef LUAEX_SERIALIZE
+/* native serializer copies data as is */
+static size_t byte_serializer (lua_State *L, int idx, void *buf, size_t size) {
+  ByteState *byte = (ByteState *) lua_touserdata(L, idx);
+  if (size >= byte->size && byte->size > 0)
+    memcpy(buf, byte->data, byte->size);
+  return byte->size;
+}
+
+
+static void byte_deserializer (lua_State *L, const void *data, size_t size) {
+  ByteState *byte = (ByteState *) lua_newuserdata(L, sizeof(ByteState));
+  byte->data = NULL;
+  byte->size = 0;
+  luaL_setmetatable(L, LUA_BYTEHANDLE);
+  if (size > 0) {
+    byte->data = (unsigned char *) malloc(size);
+    if (byte->data == NULL)
+      luaL_error(L, _("not enough memory"));
+    memcpy(byte->data, data, size);
+    byte->size = size;
+  }
+}
+#endif
+
+
 LUAMOD_API int luaopen_byte (lua_State *L) {
   /* register library */
   luaL_newlib(L, byte_lib);  /* new module */
@@ -206,6 +233,9 @@ LUAMOD_API int luaopen_byte (lua_State *L) {
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_setfuncs(L, byte_methods, 0);  /* add methods to new metatable */
   lua_pop(L, 1);  /* pop new metatable */
+#ifdef LUAEX_SERIALIZE
+  lua_setserializer(L, LUA_BYTEHANDLE, byte_serializer, byte_deserializer);
+#endif
   return 1;
 }
 
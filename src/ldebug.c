@@ -89,6 +89,10 @@ LUA_API void lua_sethook (lua_State *L, lua_Hook func, int mask, int count) {
   L->basehookcount = count;
   resethookcount(L);
   L->hookmask = cast_byte(mask);
+#ifdef LUAEX_THREADLIB
+  if (luaE_atomicget(&L->canceled))  /* do not lose cancel from other thread */
+    luaE_atomicor(&L->hookmask, LUA_MASKCOUNT);
+#endif
 }
 
 
@@ -666,6 +670,10 @@ l_noret luaG_runerror (lua_State *L, const char *fmt, ...) {
 void luaG_traceexec (lua_State *L) {
   CallInfo *ci = L->ci;
   lu_byte mask = L->hookmask;
+#ifdef LUAEX_THREADLIB
+  if (L->canceled)  /* canceled by 'lua_cancel'? */
+    luaG_runerror(L, "canceled");
+#endif
   int counthook = (--L->hookcount == 0 && (mask & LUA_MASKCOUNT));
   if (counthook)
     resethookcount(L);  /* reset count */
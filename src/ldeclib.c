@@ -19,6 +19,7 @@
 
 #ifdef LUAEX_MPDECIMAL
 #include <malloc.h>
+#include <string.h>
 #include <mpdecimal.h>
 
 #define LUA_DECIMALHANDLE "DECIMAL*"
@@ -447,6 +448,61 @@ static int dec_gc (lua_State *L) {
 }
 
 
+#ifdef LUAEX_SERIALIZE
+/* serialized decimal is flags, exponent and words of coefficient */
+#define DEC_HEADERSIZE (1 + sizeof(mpd_ssize_t))
+
+
+/* native serializer copies coefficient as is */
+static size_t dec_serializer (lua_State *L, int idx, void *buf, size_t size) {
+  DecimalState *dec = (DecimalState *) lua_touserdata(L, idx);
+  size_t n = DEC_HEADERSIZE + (size_t) dec->v.len * sizeof(mpd_uint_t);
+  if (size >= n) {
+    char *p = (char *) buf;
+    p[0] = (char) (dec->v.flags & (MPD_NEG | MPD_SPECIAL));
+    memcpy(p + 1, &dec->v.exp, sizeof(mpd_ssize_t));
+    memcpy(p + DEC_HEADERSIZE, dec->v.data, n - DEC_HEADERSIZE);
+  }
+  return n;
+}
+
+
+static void dec_deserializer (lua_State *L, const void *data, size_t size) {
+  const char *p = (const char *) data;
+  if (size < DEC_HEADERSIZE || (size - DEC_HEADERSIZE) % sizeof(mpd_uint_t) != 0)
+    luaL_error(L, _("invalid serialized decimal"));
+  uint8_t flags = (uint8_t) p[0];
+  uint8_t special = flags & MPD_SPECIAL;
+  mpd_ssize_t exp;
+  memcpy(&exp, p + 1, sizeof(mpd_ssize_t));
+  mpd_ssize_t len = (mpd_ssize_t) ((size - DEC_HEADERSIZE) / sizeof(mpd_uint_t));
+  /* one kind of special value, finite value has coefficient and exponent in range */
+  if ((flags & ~(MPD_NEG | MPD_SPECIAL)) != 0 || (special & (special - 1)) != 0 ||
+      (!special && (len == 0 || exp < MPD_MIN_ETINY || exp > MPD_MAX_EMAX)))
+    luaL_error(L, _("invalid serialized decimal"));
+  DecimalState *dec = create(L);
+  if (len > DEC_MINALLOC) {
+    uint32_t status = 0;
+    mpd_qresize(MPD(dec), len, &status);
+    dec_addstatus(L, status);
+  }
+  memcpy(dec->v.data, p + DEC_HEADERSIZE, (size_t) len * sizeof(mpd_uint_t));
+  /* coefficient or payload of NaN is normalized words of radix */
+  mpd_ssize_t i;
+  for (i = 0; i < len; i++)
+    if (dec->v.data[i] >= MPD_RADIX)
+      luaL_error(L, _("invalid serialized decimal"));
+  if (len > 1 && dec->v.data[len - 1] == 0)
+    luaL_error(L, _("invalid serialized decimal"));
+  dec->v.exp = exp;
+  dec->v.len = len;
+  mpd_set_flags(MPD(dec), flags);
+  if (len > 0)
+    mpd_setdigits(MPD(dec));
+}
+#endif
+
+
 /*
 ** functions for 'decimal' library
 */
@@ -570,6 +626,9 @@ LUAMOD_API int luaopen_decimal (lua_State *L) {
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_setfuncs(L, dec_methods, 0);  /* add methods to new metatable */
   lua_pop(L, 1);  /* pop new metatable */
+#ifdef LUAEX_SERIALIZE
+  lua_setserializer(L, LUA_DECIMALHANDLE, dec_serializer, dec_deserializer);
+#endif
   /* register PI constant */
   lua_pushcfunction(L, dec_new);
   lua_pushstring(L, "3.141592653589793238462643383279502884");
@@ -17,6 +17,7 @@
 
 #ifdef LUAEX_PCRE
 #include <stdio.h>
+#include <string.h>
 #include <pcre.h>
 
 
@@ -182,6 +183,39 @@ static int re_gsub (lua_State *L) {
 }
 
 
+#ifdef LUAEX_SERIALIZE
+/* compiled pattern is at least as its header */
+#define MINPATTERNSIZE 64
+
+
+/* native serializer copies compiled pattern as is */
+static size_t re_serializer (lua_State *L, int idx, void *buf, size_t size) {
+  reState *state = (reState *) lua_touserdata(L, idx);
+  size_t n;
+  if (pcre_fullinfo(state->re, NULL, PCRE_INFO_SIZE, &n) != 0)
+    luaL_error(L, _("cannot serialize pattern"));
+  if (size >= n)
+    memcpy(buf, state->re, n);
+  return n;
+}
+
+
+static void re_deserializer (lua_State *L, const void *data, size_t size) {
+  reState *state = (reState *) lua_newuserdata(L, sizeof(reState));
+  size_t n = (size < MINPATTERNSIZE) ? MINPATTERNSIZE : size;
+  state->re = (pcre *) pcre_malloc(n);
+  if (state->re == NULL)
+    luaL_error(L, _("not enough memory"));
+  memset(state->re, 0, n);
+  memcpy(state->re, data, size);
+  luaL_setmetatable(L, LUA_PCREHANDLE);
+  /* check magic number and size of pattern */
+  if (pcre_fullinfo(state->re, NULL, PCRE_INFO_SIZE, &n) != 0 || n != size)
+    luaL_error(L, _("invalid serialized pattern"));
+}
+#endif
+
+
 /*
 ** functions for 're' library
 */
@@ -216,6 +250,9 @@ LUAMOD_API int luaopen_re (lua_State *L) {
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_setfuncs(L, re_methods, 0);  /* add methods to new metatable */
   lua_pop(L, 1);  /* pop new metatable */
+#ifdef LUAEX_SERIALIZE
+  lua_setserializer(L, LUA_PCREHANDLE, re_serializer, re_deserializer);
+#endif
   return 1;
 }
 
@@ -12,28 +12,66 @@
 #include "lua.h"
 #include "lauxlib.h"
 
+#include "lapi.h"
+#include "lfunc.h"
+#include "lobject.h"
+#include "lstate.h"
+
 
 #ifdef LUAEX_SERIALIZE
 #include <string.h>
 #include <math.h>
 #include <malloc.h>
+#include <stdint.h>
+#include <limits.h>
 
 #define GROW_POINTER 64
+#define STREAM_BUFFERSIZE 65536
+
+/* caches of dumped and loaded functions in registry */
+#define DUMPS "_DUMPS"
+#define PROTOS "_PROTOS"
+/* native serializers of userdata in registry */
+#define SERIALIZERS "_SERIALIZERS"
+#define MAXPROTOS 256
+#define HASHSIZE sizeof(lua_Integer)
+
+/* serialized table or function with its reference id */
+typedef struct {
+  const void *p;
+  lua_Unsigned id;
+} PointerId;
 
 typedef struct {
   char *b;
   size_t size;
   size_t n;
-  void **p;
-  size_t psize;
-  size_t pn;
+  PointerId *h;  /* open addressing hash of pointers */
+  size_t hsize;  /* power of 2 */
+  size_t hn;
+  lua_Writer writer;  /* stream buffer to writer or NULL */
+  void *ud;
   lua_State *L;
 } StringBuilder;
 
 
+static void b_flush (StringBuilder *B) {
+  if (B->n > 0 && B->writer(B->L, B->b, B->n, B->ud))
+    luaL_error(B->L, _("cannot write serialized data"));
+  B->n = 0;
+}
+
+
 static void b_grow (StringBuilder *B, size_t sz) {
   if (B->size - B->n < sz) {
-    size_t newsize = B->n + sz + LUAL_BUFFERSIZE;
+    if (B->writer) {
+      b_flush(B);
+      if (B->size >= sz)
+        return;
+    }
+    size_t newsize = B->size * 2;
+    if (newsize < B->n + sz + LUAL_BUFFERSIZE)
+      newsize = B->n + sz + LUAL_BUFFERSIZE;
     char *temp = (char *) realloc(B->b, newsize);
     if (temp == NULL)
       luaL_error(B->L, _("not enough memory"));
@@ -43,148 +81,323 @@ static void b_grow (StringBuilder *B, size_t sz) {
 }
 
 
-#define b_addlstring(B,s,sz) (b_grow(B, sz), memcpy(&B->b[B->n], s, sz), B->n += sz)
+static void b_addlstring (StringBuilder *B, const void *s, size_t sz) {
+  if (B->writer && sz >= STREAM_BUFFERSIZE) {
+    /* write large data as is */
+    b_flush(B);
+    if (B->writer(B->L, s, sz, B->ud))
+      luaL_error(B->L, _("cannot write serialized data"));
+    return;
+  }
+  b_grow(B, sz);
+  memcpy(&B->b[B->n], s, sz);
+  B->n += sz;
+}
+
+
 #define b_addchar(B,c) (b_grow(B, 1), (B)->b[(B)->n++] = (c))
 #define b_addchar_unsafe(B,c) (B)->b[(B)->n++] = (c)
 
 
-static void b_addpointer (StringBuilder *B, const void *p) {
-  b_grow(B, sizeof(void *) * 2 + 2);
-  b_addchar_unsafe(B, '{');
-  unsigned char *s = (unsigned char *) p;
-  unsigned char *e = s + sizeof(void *);
-  for (; s < e; s++) {
-    b_addchar_unsafe(B, (char) ('A' + (*s >> 4)));    /* high 4 bits as A-P char */
-    b_addchar_unsafe(B, (char) ('A' + (*s & 0x0F)));  /* low 4 bits as A-P char */
+/* binary format: signature, then values as type tag and payload */
+#define SIGNATURE '\x1b'
+
+enum {
+  T_NIL,       /* nil */
+  T_FALSE,     /* false */
+  T_TRUE,      /* true */
+  T_INT,       /* zigzag varint */
+  T_FLOAT,     /* raw lua_Number */
+  T_STRING,    /* varint length, raw bytes */
+  T_TABLE,     /* varint count of array items and pairs, metatable or nil, items, pairs */
+  T_FUNCTION,  /* varint length, hash and dump, upvalues, T_END */
+  T_REF,       /* varint id of table or function serialized before */
+  T_USERDATA,  /* metatable name, __serialize result */
+  T_ENV,       /* upvalue _ENV */
+  T_END,       /* end of entries */
+  T_RECORDS,   /* varint count of fields and rows, field names, columns */
+  T_NATIVE     /* metatable name, varint size and data of native serializer */
+};
+
+/* column of records */
+enum {
+  COL_VALUES,   /* values of rows */
+  COL_INTEGERS  /* zigzag varint differences of integers */
+};
+
+#define zigzag(i) (((i) < 0) ? ~((lua_Unsigned) (i) << 1) : (lua_Unsigned) (i) << 1)
+#define unzigzag(u) ((lua_Integer) (((u) >> 1) ^ (0 - ((u) & 1))))
+
+
+typedef struct Serializer {
+  lua_Serializer s;
+  lua_Deserializer d;
+} Serializer;
+
+
+/* registered serializer of metatable name or NULL */
+static const Serializer* getserializer (lua_State *L, const char *tname) {
+  const Serializer *h = NULL;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, SERIALIZERS) == LUA_TTABLE) {
+    if (lua_getfield(L, -1, tname) == LUA_TUSERDATA)
+      h = (const Serializer *) lua_touserdata(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return h;  /* userdata is kept by registry */
+}
+
+
+LUA_API void lua_setserializer (lua_State *L, const char *tname, lua_Serializer s, lua_Deserializer d) {
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, SERIALIZERS);
+  Serializer *h = (Serializer *) lua_newuserdata(L, sizeof(Serializer));
+  h->s = s;
+  h->d = d;
+  lua_setfield(L, -2, tname);
+  lua_pop(L, 1);
+}
+
+
+static void b_addvarint (StringBuilder *B, lua_Unsigned u) {
+  b_grow(B, sizeof(lua_Unsigned) + 3);
+  while (u >= 0x80) {
+    b_addchar_unsafe(B, (char) (u | 0x80));
+    u >>= 7;
   }
-  b_addchar_unsafe(B, '}');
+  b_addchar_unsafe(B, (char) u);
+}
+
+
+static size_t hashpointer (const void *p) {
+  size_t h = (size_t) ((uintptr_t) p >> 3);
+  h ^= h >> 15;
+  h *= (size_t) 2654435761u;
+  return h ^ (h >> 13);
 }
 
 
-static int b_hashing (StringBuilder *B, const void *hashptr) {
+static void b_rehash (StringBuilder *B) {
+  size_t newsize = (B->hsize) ? B->hsize * 2 : GROW_POINTER;
+  PointerId *h = (PointerId *) calloc(newsize, sizeof(PointerId));
+  if (h == NULL)
+    luaL_error(B->L, _("not enough memory"));
   size_t i;
-  for (i = 0; i < B->pn; i++) {
-    if (B->p[i] == hashptr)
-      return 1;
+  for (i = 0; i < B->hsize; i++) {
+    if (B->h[i].p) {
+      size_t j = hashpointer(B->h[i].p) & (newsize - 1);
+      while (h[j].p)
+        j = (j + 1) & (newsize - 1);
+      h[j] = B->h[i];
+    }
   }
-  if (B->psize - B->pn < 1) {
-    size_t newsize = B->pn + GROW_POINTER;
-    void **temp = (void **) realloc(B->p, newsize * sizeof(void *));
-    if (temp == NULL)
-      luaL_error(B->L, _("not enough memory"));
-    B->p = temp;
-    B->psize = newsize;
+  free(B->h);
+  B->h = h;
+  B->hsize = newsize;
+}
+
+
+/* return true and id if pointer is serialized before, else add it with next id */
+static int b_hashing (StringBuilder *B, const void *hashptr, lua_Unsigned *id) {
+  if (B->hn >= B->hsize / 2)
+    b_rehash(B);
+  size_t mask = B->hsize - 1;
+  size_t i = hashpointer(hashptr) & mask;
+  for (; B->h[i].p; i = (i + 1) & mask) {
+    if (B->h[i].p == hashptr) {
+      *id = B->h[i].id;
+      return 1;
+    }
   }
-  B->p[B->pn++] = (void *) hashptr;
+  B->h[i].p = hashptr;
+  B->h[i].id = ++B->hn;
   return 0;
 }
 
 
-static int writer (lua_State *L, const void *b, size_t size, void *B) {
+static int writer (lua_State *L, const void *b, size_t size, void *ud) {
   (void) L;
-  b_grow(B, size * 2);
-  unsigned char *s = (unsigned char *) b;
-  unsigned char *e = s + size;
-  for (; s < e; s++) {
-    b_addchar_unsafe((StringBuilder *) B, (char) ('A' + (*s >> 4)));    /* high 4 bits as A-P char */
-    b_addchar_unsafe((StringBuilder *) B, (char) ('A' + (*s & 0x0F)));  /* low 4 bits as A-P char */
-  }
+  luaL_addlstring((luaL_Buffer *) ud, (const char *) b, size);
   return 0;
 }
 
 
+/* FNV-1a hash of bytecode */
+static lua_Integer hashcode (const char *s, size_t l) {
+  lua_Unsigned h = 14695981039346656037u;
+  const unsigned char *p = (const unsigned char *) s;
+  const unsigned char *e = p + l;
+  for (; p < e; p++) {
+    h ^= *p;
+    h *= 1099511628211u;
+  }
+  return (lua_Integer) h;
+}
+
+
+/* prototype of Lua function idx or NULL */
+static const Proto* b_proto (lua_State *L, int idx) {
+  if (lua_type(L, idx) != LUA_TFUNCTION || lua_iscfunction(L, idx))
+    return NULL;
+  return ((const LClosure *) lua_topointer(L, idx))->p;
+}
+
+
+/*
+** Push hash with dump of function idx, prototype is dumped once while
+** some its function exists: cache maps prototype to function and
+** function to dump, both weak
+*/
+static const char* b_dump (lua_State *L, int idx, size_t *l) {
+  idx = lua_absindex(L, idx);
+  if (luaL_getsubtable(L, LUA_REGISTRYINDEX, DUMPS) == 0) {
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "kv");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+  }
+  const Proto *p = b_proto(L, idx);
+  /* function of same prototype is alive, so address of prototype is not reused */
+  if (p && lua_rawgetp(L, -1, p) == LUA_TFUNCTION && b_proto(L, -1) == p)
+    lua_rawget(L, -2);
+  else {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  if (lua_type(L, -1) != LUA_TSTRING) {
+    lua_pop(L, 1);
+    luaL_Buffer b;
+    lua_pushvalue(L, idx);
+    luaL_buffinit(L, &b);
+    luaL_prepbuffsize(&b, HASHSIZE);
+    luaL_addsize(&b, HASHSIZE);  /* place of hash */
+    if (lua_dump(L, writer, &b, 0))
+      luaL_error(L, _("cannot serialize function"));
+    lua_Integer hash = hashcode(b.b + HASHSIZE, b.n - HASHSIZE);
+    memcpy(b.b, &hash, HASHSIZE);
+    luaL_pushresult(&b);
+    lua_remove(L, -2);
+    if (p) {
+      lua_pushvalue(L, idx);
+      lua_rawsetp(L, -3, p);
+      lua_pushvalue(L, idx);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -4);
+    }
+  }
+  lua_remove(L, -2);
+  return lua_tolstring(L, -1, l);
+}
+
+
+/* key is integer of array part 1..n */
+static int isarraykey (lua_State *L, int idx, lua_Integer n) {
+  if (!lua_isinteger(L, idx))
+    return 0;
+  lua_Integer k = lua_tointeger(L, idx);
+  return k >= 1 && k <= n;
+}
+
+
 static void serialize (lua_State *L, StringBuilder *b, int idx) {
-  b_addchar(b, '{');
+  idx = lua_absindex(L, idx);
   switch (lua_type(L, idx)) {
     case LUA_TNIL:
       /* serialize nil */
-      b_addchar(b, '#');
+      b_addchar(b, T_NIL);
       break;
 	  
     case LUA_TBOOLEAN:
       /* serialize boolean */
-      b_addchar(b, 'B');
-      b_addchar(b, (lua_toboolean(L, idx)) ? '1' : '0');
+      b_addchar(b, (lua_toboolean(L, idx)) ? T_TRUE : T_FALSE);
       break;
 	  
-    case LUA_TNUMBER: {
-      /* serialize number */
-      lua_Number number = lua_tonumber(L, idx);
-      if (trunc(number) == number) {
-        /* serialize as integer */
-        b_addchar(b, 'I');
-        lua_pushfstring(L, "%I", lua_tointeger(L, idx));
+    case LUA_TNUMBER:
+      if (lua_isinteger(L, idx)) {
+        /* serialize integer as zigzag varint */
+        lua_Integer i = lua_tointeger(L, idx);
+        b_addchar(b, T_INT);
+        b_addvarint(b, zigzag(i));
       } else {
-        /* serialize as float */
-        b_addchar(b, 'N');
-        lua_pushfstring(L, "%f", number);
+        /* serialize float as is */
+        lua_Number number = lua_tonumber(L, idx);
+        b_addchar(b, T_FLOAT);
+        b_addlstring(b, &number, sizeof(lua_Number));
       }
-      size_t l;
-      const char *s = lua_tolstring(L, -1, &l);
-      b_addlstring(b, s, l);
-      lua_pop(L, 1);
       break;
-    }
 	
     case LUA_TSTRING: {
-      /* serialize string as binary */
+      /* serialize string as length and bytes */
       size_t l;
-      unsigned char *s = (unsigned char *) lua_tolstring(L, idx, &l);
-      unsigned char *e = s + l;
-      b_grow(b, l * 2 + 1);
-      b_addchar_unsafe(b, 'S');
-      for (; s < e; s++) {
-        b_addchar_unsafe(b, (char) ('A' + (*s >> 4)));    /* high 4 bits as A-P char */
-        b_addchar_unsafe(b, (char) ('A' + (*s & 0x0F)));  /* low 4 bits as A-P char */
-      }
+      const char *s = lua_tolstring(L, idx, &l);
+      b_addchar(b, T_STRING);
+      b_addvarint(b, l);
+      b_addlstring(b, s, l);
       break;
     }
 	  
     case LUA_TTABLE: {
-      /* serialize table */
-      const void *p = lua_topointer(L, idx);
-      if (b_hashing(b, p)) {
-        b_addchar(b, 'P');
-        b_addpointer(b, p);
+      /* serialize table or reference id */
+      lua_Unsigned id;
+      if (b_hashing(b, lua_topointer(L, idx), &id)) {
+        b_addchar(b, T_REF);
+        b_addvarint(b, id);
         break;
       }
-      b_addchar(b, 'T');
-      /* serialize table pointer as identificator */
-      b_addpointer(b, p);
-      /* serialize metatable */
-      if (lua_getmetatable(L, idx)) {
-        b_addchar(b, '#');
+      luaL_checkstack(L, 4, _("table is too deep"));
+      lua_pushvalue(L, idx);
+      /* count pairs out of array part 1..n */
+      lua_Integer narr = (lua_Integer) lua_rawlen(L, -1);
+      lua_Integer nrec = 0;
+      lua_Integer i;
+      lua_pushnil(L);
+      while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        if (!isarraykey(L, -1, narr))
+          nrec++;
+      }
+      b_addchar(b, T_TABLE);
+      b_addvarint(b, (lua_Unsigned) narr);
+      b_addvarint(b, (lua_Unsigned) nrec);
+      /* serialize metatable or nil */
+      if (lua_getmetatable(L, -1)) {
+        serialize(L, b, -1);
+        lua_pop(L, 1);
+      } else
+        b_addchar(b, T_NIL);
+      /* serialize array items */
+      for (i = 1; i <= narr; i++) {
+        lua_rawgeti(L, -1, i);
         serialize(L, b, -1);
         lua_pop(L, 1);
       }
-      /* serialize entries */
-      lua_pushvalue(L, idx);
+      /* serialize pairs */
       lua_pushnil(L);
       while (lua_next(L, -2)) {
-        serialize(L, b, -2);
-        serialize(L, b, -1);
+        if (!isarraykey(L, -2, narr)) {
+          serialize(L, b, -2);
+          serialize(L, b, -1);
+        }
         lua_pop(L, 1);
       }
       lua_pop(L, 1);
       break;
     }
     case LUA_TFUNCTION: {
-      /* serialize function */
-      const void *p = lua_topointer(L, idx);
-      if (b_hashing(b, p)) {
-        b_addchar(b, 'P');
-        b_addpointer(b, p);
+      /* serialize function or reference id */
+      lua_Unsigned id;
+      if (b_hashing(b, lua_topointer(L, idx), &id)) {
+        b_addchar(b, T_REF);
+        b_addvarint(b, id);
         break;
       }
-      b_addlstring(b, "F{S", 3);
-      /* dump function */
-      lua_pushvalue(L, idx);
-      if (lua_dump(L, writer, b, 0))
-        luaL_error(L, _("cannot serialize function"));
+      luaL_checkstack(L, LUA_MINSTACK, _("function is too deep"));
+      b_addchar(b, T_FUNCTION);
+      /* serialize hash with dump */
+      size_t l;
+      const char *s = b_dump(L, idx, &l);
+      b_addvarint(b, l - HASHSIZE);
+      b_addlstring(b, s, l);
       lua_pop(L, 1);
-      b_addchar(b, '}');
-      /* serialize pointer */
-      b_addpointer(b, p);
       /* serialize upvalues */
       int i;
       const char *name;
@@ -193,17 +406,37 @@ static void serialize (lua_State *L, StringBuilder *b, int idx) {
         if (strcmp(name, "_ENV") != 0)
           serialize(L, b, -1);
         else
-          b_addchar(b, '#');
+          b_addchar(b, T_ENV);
         lua_pop(L, 1);
       }
+      b_addchar(b, T_END);
       break;
     }
     case LUA_TUSERDATA:
-      /* serialize userdata if possible */
+      /* serialize userdata by native serializer */
+      if (luaL_getmetafield(L, idx, "__name") != LUA_TNIL) {
+        size_t l;
+        const char *name = lua_tolstring(L, -1, &l);
+        const Serializer *h = (name) ? getserializer(L, name) : NULL;
+        if (h) {
+          b_addchar(b, T_NATIVE);
+          b_addvarint(b, l);
+          b_addlstring(b, name, l);
+          size_t size = h->s(L, idx, NULL, 0);
+          b_addvarint(b, size);
+          b_grow(b, size);
+          h->s(L, idx, &b->b[b->n], size);
+          b->n += size;
+          lua_pop(L, 1);
+          break;
+        }
+        lua_pop(L, 1);
+      }
+      /* serialize userdata by __serialize if possible */
       if (luaL_getmetafield(L, idx, "__serialize")) {
         /* get metatable name */
         if (luaL_getmetafield(L, idx, "__name")) {
-          b_addchar(b, 'U');
+          b_addchar(b, T_USERDATA);
           /* serialize metatable name */
           serialize(L, b, -1);
           lua_pop(L, 1);
@@ -224,7 +457,6 @@ static void serialize (lua_State *L, StringBuilder *b, int idx) {
       luaL_error(L, _("cannot serialize %s"), lua_typename(L, lua_type(L, idx)));
       break;
   }
-  b_addchar(b, '}');
 }
 
 
@@ -232,30 +464,32 @@ static int bgc (lua_State *L) {
   StringBuilder *B = (StringBuilder *) lua_touserdata(L, 1);
   if (B->b)
     free(B->b);
-  if (B->p)
-    free(B->p);
+  if (B->h)
+    free(B->h);
   return 0;
 }
 
 
-LUA_API void lua_serialize (lua_State *L, int idx, int lastidx) {
-  /* to absolute index */
-  idx = lua_absindex(L, idx);
-  lastidx = lua_absindex(L, lastidx);
-  /* initialize buffer with hash pointers */
+static StringBuilder* newbuilder (lua_State *L, lua_Writer writer, void *ud) {
   StringBuilder *B = (StringBuilder *) lua_newuserdata(L, sizeof(StringBuilder));
   B->b = NULL;
-  B->p = NULL;
-  B->size = B->psize = 0;
-  B->n = B->pn = 0;
+  B->h = NULL;
+  B->size = B->hsize = 0;
+  B->n = B->hn = 0;
+  B->writer = writer;
+  B->ud = ud;
   B->L = L;
   if (luaL_newmetatable(L, "StringBuilder")) {
     lua_pushcfunction(L, bgc);
     lua_setfield(L, -2, "__gc");
   }
   lua_setmetatable(L, -2);
-  int top = lua_gettop(L);
-  /* serialize values */
+  return B;
+}
+
+
+static void serializeall (lua_State *L, StringBuilder *B, int idx, int lastidx) {
+  b_addchar(B, SIGNATURE);
   if (lastidx >= idx) {
     for (; idx <= lastidx; idx++)
       serialize(L, B, idx);
@@ -263,13 +497,103 @@ LUA_API void lua_serialize (lua_State *L, int idx, int lastidx) {
     for (; idx >= lastidx; idx--)
       serialize(L, B, idx);
   }
+}
+
+
+LUA_API void lua_serialize (lua_State *L, int idx, int lastidx) {
+  /* to absolute index */
+  idx = lua_absindex(L, idx);
+  lastidx = lua_absindex(L, lastidx);
+  /* initialize buffer with hash pointers */
+  StringBuilder *B = newbuilder(L, NULL, NULL);
+  int top = lua_gettop(L);
+  /* serialize values */
+  serializeall(L, B, idx, lastidx);
   /* push serialized as string */
   lua_pushlstring(B->L, B->b, B->n);
   lua_remove(L, top);
 }
 
 
-#define check(L,cond,v) if (!(cond)) luaL_error(L, _("serialized data malformed, expected '%s'"))
+/* serialize rows of table idx as records with field names of list fields */
+LUA_API void lua_serializerecords (lua_State *L, int idx, int fields) {
+  /* to absolute index */
+  idx = lua_absindex(L, idx);
+  fields = lua_absindex(L, fields);
+  luaL_checktype(L, idx, LUA_TTABLE);
+  luaL_checktype(L, fields, LUA_TTABLE);
+  lua_Integer nrows = (lua_Integer) lua_rawlen(L, idx);
+  lua_Integer nfields = (lua_Integer) lua_rawlen(L, fields);
+  if (nfields == 0)
+    luaL_error(L, _("list of field names is empty"));
+  StringBuilder *B = newbuilder(L, NULL, NULL);
+  int top = lua_gettop(L);
+  b_addchar(B, SIGNATURE);
+  b_addchar(B, T_RECORDS);
+  b_addvarint(B, (lua_Unsigned) nfields);
+  b_addvarint(B, (lua_Unsigned) nrows);
+  /* field names */
+  lua_Integer i, row;
+  for (i = 1; i <= nfields; i++) {
+    size_t l;
+    if (lua_rawgeti(L, fields, i) != LUA_TSTRING)
+      luaL_error(L, _("field name must be string"));
+    const char *s = lua_tolstring(L, -1, &l);
+    b_addvarint(B, l);
+    b_addlstring(B, s, l);
+    lua_pop(L, 1);
+  }
+  /* columns */
+  for (i = 1; nrows > 0 && i <= nfields; i++) {
+    lua_rawgeti(L, fields, i);
+    int integers = 1;
+    for (row = 1; row <= nrows && integers; row++) {
+      if (lua_rawgeti(L, idx, row) != LUA_TTABLE)
+        luaL_error(L, _("record %d is not table"), (int) row);
+      lua_pushvalue(L, -2);
+      lua_rawget(L, -2);
+      integers = lua_isinteger(L, -1);
+      lua_pop(L, 2);
+    }
+    b_addchar(B, (integers) ? COL_INTEGERS : COL_VALUES);
+    lua_Integer prev = 0;
+    for (row = 1; row <= nrows; row++) {
+      if (lua_rawgeti(L, idx, row) != LUA_TTABLE)
+        luaL_error(L, _("record %d is not table"), (int) row);
+      lua_pushvalue(L, -2);
+      lua_rawget(L, -2);
+      if (integers) {
+        lua_Integer v = lua_tointeger(L, -1);
+        lua_Integer d = (lua_Integer) ((lua_Unsigned) v - (lua_Unsigned) prev);
+        b_addvarint(B, zigzag(d));
+        prev = v;
+      } else
+        serialize(L, B, -1);
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+  }
+  /* push serialized as string */
+  lua_pushlstring(L, B->b, B->n);
+  lua_remove(L, top);
+}
+
+
+LUA_API void lua_serializeto (lua_State *L, int idx, int lastidx, lua_Writer writer, void *ud) {
+  /* to absolute index */
+  idx = lua_absindex(L, idx);
+  lastidx = lua_absindex(L, lastidx);
+  /* initialize stream buffer with hash pointers */
+  StringBuilder *B = newbuilder(L, writer, ud);
+  b_grow(B, STREAM_BUFFERSIZE);
+  /* serialize values */
+  serializeall(L, B, idx, lastidx);
+  b_flush(B);
+  lua_pop(L, 1);
+}
+
+
+#define check(L,cond,v) if (!(cond)) luaL_error(L, _("serialized data malformed, expected '%s'"), v)
 #define checkavail(L,cond) if (!(cond)) luaL_error(L, _("serialized data break"))
 
 
@@ -289,6 +613,7 @@ static const char* nextclose (lua_State *L, const char *s, const char *e) {
   return s + 1;
 }
 
+/* deserialize text format of previous versions */
 static int deserialize (lua_State *L, const char *s, const char *e, int top) {
   int nresults = 0;
   const char *p;
@@ -408,7 +733,9 @@ static int deserialize (lua_State *L, const char *s, const char *e, int top) {
         int n = 1;
         for (;;) {
           if (*s == '#') {
-            n++;
+            /* _ENV is not always first upvalue */
+            lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+            lua_setupvalue(L, -2, n++);
             checkavail(L, ++s < e);
           } else if (*s == '{') {
             p = s; s = nextclose(L, s, e);
@@ -450,17 +777,532 @@ static int deserialize (lua_State *L, const char *s, const char *e, int top) {
 }
 
 
+typedef struct Stream {
+  const char *s;
+  const char *e;
+  int refs;  /* index of list of deserialized tables and functions */
+  lua_Integer nrefs;
+  struct Frame *frames;  /* incomplete values */
+  int nframes;
+  int framecap;
+  lua_Reader reader;  /* reader of next blocks or NULL */
+  void *ud;
+  char *buf;  /* rest of data joined with next blocks */
+  size_t bufsize;
+  int inbuf;  /* data is in buf */
+} Stream;
+
+
+static void r_reserve (lua_State *L, Stream *S, size_t size) {
+  if (S->bufsize < size) {
+    /* data of Lua string or block is not larger */
+    if (size > MAX_SIZE)
+      luaL_error(L, _("serialized data is too large"));
+    size_t newsize = (S->bufsize < MAX_SIZE / 2) ? S->bufsize * 2 : MAX_SIZE;
+    if (newsize < size)
+      newsize = size;
+    char *temp = (char *) realloc(S->buf, newsize);
+    if (temp == NULL)
+      luaL_error(L, _("not enough memory"));
+    S->buf = temp;
+    S->bufsize = newsize;
+  }
+}
+
+
+/* read next block, return false at end of data */
+static int r_read (lua_State *L, Stream *S) {
+  size_t avail = (S->e > S->s) ? (size_t) (S->e - S->s) : 0;
+  /* keep rest of data in buffer, reader may reuse its block */
+  if (S->inbuf)
+    memmove(S->buf, S->s, avail);
+  else if (avail > 0) {
+    r_reserve(L, S, avail);
+    memcpy(S->buf, S->s, avail);
+  }
+  S->inbuf = (avail > 0);
+  if (S->inbuf) {
+    S->s = S->buf;
+    S->e = S->buf + avail;
+  }
+  size_t size;
+  const char *p = S->reader(L, S->ud, &size);
+  if (p == NULL || size == 0)
+    return 0;
+  if (size > MAX_SIZE - avail)
+    luaL_error(L, _("serialized data is too large"));
+  if (!S->inbuf) {
+    /* use block as is */
+    S->s = p;
+    S->e = p + size;
+    return 1;
+  }
+  r_reserve(L, S, avail + size);
+  memcpy(S->buf + avail, p, size);
+  S->s = S->buf;
+  S->e = S->buf + avail + size;
+  return 1;
+}
+
+
+/* make sure n bytes are available */
+static void r_fill (lua_State *L, Stream *S, size_t n) {
+  while ((size_t) (S->e - S->s) < n)
+    checkavail(L, S->reader && r_read(L, S));
+}
+
+
+static const char* r_bytes (lua_State *L, Stream *S, size_t n) {
+  r_fill(L, S, n);
+  const char *p = S->s;
+  S->s += n;
+  return p;
+}
+
+
+static lua_Unsigned r_varint (lua_State *L, Stream *S) {
+  lua_Unsigned u = 0;
+  int shift = 0;
+  for (;;) {
+    r_fill(L, S, 1);
+    check(L, shift < (int) sizeof(lua_Unsigned) * 8, "varint");
+    unsigned char c = (unsigned char) *S->s++;
+    u |= (lua_Unsigned) (c & 0x7F) << shift;
+    if (c < 0x80)
+      return u;
+    shift += 7;
+  }
+}
+
+
+/* register table or function on top with next id */
+static void r_addref (lua_State *L, Stream *S) {
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, S->refs, ++S->nrefs);
+}
+
+
+/* deserialized table, function or userdata waiting for next value */
+enum {
+  F_META,     /* metatable of table */
+  F_ARRAY,    /* item of array part of table */
+  F_KEY,      /* key of table */
+  F_VALUE,    /* value of table */
+  F_UPVALUE,  /* upvalue of function or end */
+  F_UDNAME,   /* metatable name of userdata */
+  F_UDDATA,   /* __serialize result of userdata */
+  F_RECORD    /* value of column of records */
+};
+
+typedef struct Frame {
+  int kind;
+  lua_Integer n;  /* next array item, upvalue or value of records */
+  lua_Integer size;  /* count of array items or rows of records */
+  lua_Integer total;  /* count of pairs or values of records */
+} Frame;
+
+#define INITFRAMES 32
+
+
+static Frame* r_pushframe (lua_State *L, Stream *S, int kind) {
+  if (S->nframes == S->framecap) {
+    /* frames is userdata at index refs + 1 */
+    int cap = S->framecap * 2;
+    Frame *frames = (Frame *) lua_newuserdata(L, sizeof(Frame) * cap);
+    memcpy(frames, S->frames, sizeof(Frame) * S->nframes);
+    lua_replace(L, S->refs + 1);
+    S->frames = frames;
+    S->framecap = cap;
+  }
+  Frame *f = &S->frames[S->nframes++];
+  f->kind = kind;
+  f->n = 1;
+  return f;
+}
+
+
+/*
+** Read columns of integers of records (rows and field names on top),
+** stop at column of values; return true if records is completed
+*/
+static int r_columns (lua_State *L, Stream *S, Frame *f) {
+  while (f->n < f->total && f->n % f->size == 0) {
+    r_fill(L, S, 1);
+    int kind = (unsigned char) *S->s++;
+    if (kind == COL_VALUES)
+      break;
+    check(L, kind == COL_INTEGERS, "column");
+    lua_rawgeti(L, -1, f->n / f->size + 1);  /* field name */
+    lua_Integer row;
+    lua_Unsigned v = 0;
+    for (row = 1; row <= f->size; row++) {
+      lua_Unsigned u = r_varint(L, S);
+      v += (lua_Unsigned) unzigzag(u);
+      lua_rawgeti(L, -3, row);
+      lua_pushvalue(L, -2);
+      lua_pushinteger(L, (lua_Integer) v);
+      lua_rawset(L, -3);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    f->n += f->size;
+  }
+  return f->n == f->total;
+}
+
+
+/*
+** Push new closure of bytecode, bytecode is loaded once and its prototype
+** is kept in cache by hash
+*/
+/* function on top is loaded from code, its dump is in cache at idx */
+static int r_samecode (lua_State *L, int idx, const char *code, size_t l) {
+  size_t cl;
+  idx = lua_absindex(L, idx);
+  lua_pushvalue(L, -1);
+  const char *c = (lua_rawget(L, idx) == LUA_TSTRING) ? lua_tolstring(L, -1, &cl) : NULL;
+  int same = (c && cl == l && memcmp(c, code, l) == 0);
+  lua_pop(L, 1);
+  return same;
+}
+
+
+static void r_function (lua_State *L, lua_Integer hash, const char *code, size_t l) {
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, PROTOS);
+  /* hash is checked by bytes of code */
+  if (lua_rawgeti(L, -1, hash) != LUA_TFUNCTION || !r_samecode(L, -2, code, l)) {
+    lua_pop(L, 1);
+    if (luaL_loadbufferx(L, code, l, "", "b"))
+      lua_error(L);
+    /* drop all prototypes when cache is full */
+    lua_Integer n = (lua_getfield(L, -2, "n") == LUA_TNUMBER) ? lua_tointeger(L, -1) : 0;
+    lua_pop(L, 1);
+    if (n >= MAXPROTOS) {
+      lua_newtable(L);
+      lua_replace(L, -3);
+      lua_pushvalue(L, -2);
+      lua_setfield(L, LUA_REGISTRYINDEX, PROTOS);
+      n = 0;
+    }
+    lua_pushinteger(L, n + 1);
+    lua_setfield(L, -3, "n");
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, hash);
+    lua_pushvalue(L, -1);
+    lua_pushlstring(L, code, l);
+    lua_rawset(L, -4);
+  }
+  /* new closure of prototype */
+  LClosure *f = (LClosure *) lua_topointer(L, -1);
+  lua_lock(L);
+  LClosure *cl = luaF_newLclosure(L, f->nupvalues);
+  cl->p = f->p;
+  setclLvalue(L, L->top, cl);
+  api_incr_top(L);
+  luaF_initupvals(L, cl);
+  lua_unlock(L);
+  lua_replace(L, -3);
+  lua_pop(L, 1);
+}
+
+
+/* pass to pairs after array items, return true if table is completed */
+static int t_completed (Frame *f) {
+  if (f->kind == F_ARRAY && f->n > f->size)
+    f->kind = F_KEY;
+  return f->kind == F_KEY && f->total == 0;
+}
+
+
+/* deserialize one value in single pass, nesting is kept in frames instead of C stack */
+static void b_deserialize (lua_State *L, Stream *S) {
+  int base = S->nframes;
+  for (;;) {
+    luaL_checkstack(L, 4, _("serialized data is too deep"));
+    r_fill(L, S, 1);
+    int c = (unsigned char) *S->s++;
+    if (c == T_END) {
+      /* end of upvalues of function */
+      check(L, S->nframes > base && S->frames[S->nframes - 1].kind == F_UPVALUE, "value");
+      S->nframes--;
+    } else {
+      switch (c) {
+        case T_NIL:
+          lua_pushnil(L);
+          break;
+        
+        case T_FALSE:
+        case T_TRUE:
+          lua_pushboolean(L, c == T_TRUE);
+          break;
+        
+        case T_INT: {
+          lua_Unsigned u = r_varint(L, S);
+          lua_pushinteger(L, unzigzag(u));
+          break;
+        }
+        case T_FLOAT: {
+          lua_Number number;
+          memcpy(&number, r_bytes(L, S, sizeof(lua_Number)), sizeof(lua_Number));
+          lua_pushnumber(L, number);
+          break;
+        }
+        case T_STRING: {
+          size_t l = (size_t) r_varint(L, S);
+          lua_pushlstring(L, r_bytes(L, S, l), l);
+          break;
+        }
+        case T_TABLE: {
+          lua_Unsigned narr = r_varint(L, S);
+          lua_Unsigned nrec = r_varint(L, S);
+          check(L, narr <= INT_MAX && nrec <= INT_MAX, "count of items");
+          /* each item takes at least one byte */
+          check(L, S->reader || narr + nrec * 2 <= (lua_Unsigned) (S->e - S->s), "count of items");
+          lua_Unsigned asize = narr, hsize = nrec;
+          if (S->reader) {
+            /* presize stream table by data read yet, it grows as usual */
+            lua_Unsigned avail = (lua_Unsigned) (S->e - S->s);
+            if (asize > avail)
+              asize = avail;
+            if (hsize > avail / 2)
+              hsize = avail / 2;
+          }
+          lua_createtable(L, (int) asize, (int) hsize);
+          r_addref(L, S);
+          Frame *f = r_pushframe(L, S, F_META);
+          f->size = (lua_Integer) narr;
+          f->total = (lua_Integer) nrec;
+          continue;
+        }
+        
+        case T_FUNCTION: {
+          size_t l = (size_t) r_varint(L, S);
+          lua_Integer hash;
+          memcpy(&hash, r_bytes(L, S, HASHSIZE), HASHSIZE);
+          r_function(L, hash, r_bytes(L, S, l), l);
+          r_addref(L, S);
+          r_pushframe(L, S, F_UPVALUE);
+          continue;
+        }
+        case T_REF: {
+          lua_Unsigned id = r_varint(L, S);
+          check(L, id >= 1 && id <= (lua_Unsigned) S->nrefs, "reference id");
+          lua_rawgeti(L, S->refs, (lua_Integer) id);
+          break;
+        }
+        case T_USERDATA:
+          r_pushframe(L, S, F_UDNAME);
+          continue;
+        
+        case T_ENV:
+          lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+          break;
+        
+        case T_NATIVE: {
+          size_t l = (size_t) r_varint(L, S);
+          lua_pushlstring(L, r_bytes(L, S, l), l);
+          const Serializer *h = getserializer(L, lua_tostring(L, -1));
+          if (h == NULL)
+            luaL_error(L, _("cannot deserialize userdata '%s'"), lua_tostring(L, -1));
+          lua_pop(L, 1);
+          l = (size_t) r_varint(L, S);
+          h->d(L, r_bytes(L, S, l), l);
+          break;
+        }
+        
+        case T_RECORDS: {
+          lua_Unsigned nfields = r_varint(L, S);
+          lua_Unsigned nrows = r_varint(L, S);
+          check(L, nfields > 0 && nfields <= INT_MAX && nrows <= INT_MAX, "count of records");
+          /* each name and value takes at least one byte */
+          check(L, S->reader || (nfields <= (lua_Unsigned) (S->e - S->s) &&
+            nrows * nfields <= (lua_Unsigned) (S->e - S->s)), "count of records");
+          /* names and first column of stream are read before rows are created */
+          if (S->reader)
+            r_fill(L, S, (size_t) (nfields + nrows));
+          /* create rows with known count of fields */
+          lua_Integer i;
+          lua_createtable(L, (int) nrows, 0);
+          for (i = 1; i <= (lua_Integer) nrows; i++) {
+            lua_createtable(L, 0, (int) nfields);
+            lua_rawseti(L, -2, i);
+          }
+          /* field names */
+          lua_createtable(L, (int) nfields, 0);
+          for (i = 1; i <= (lua_Integer) nfields; i++) {
+            size_t l = (size_t) r_varint(L, S);
+            lua_pushlstring(L, r_bytes(L, S, l), l);
+            lua_rawseti(L, -2, i);
+          }
+          Frame *f = r_pushframe(L, S, F_RECORD);
+          f->n = 0;
+          f->size = (lua_Integer) nrows;
+          f->total = (lua_Integer) (nfields * nrows);
+          if (!r_columns(L, S, f))
+            continue;
+          lua_pop(L, 1);  /* remove field names */
+          S->nframes--;
+          break;
+        }
+        
+        default:
+          luaL_error(L, _("type %d malformed"), c);
+          break;
+      }
+    }
+    /* value on top is completed, pass it to waiting frames */
+    while (S->nframes > base) {
+      Frame *f = &S->frames[S->nframes - 1];
+      if (f->kind == F_META) {
+        if (lua_istable(L, -1))
+          lua_setmetatable(L, -2);
+        else {
+          check(L, lua_isnil(L, -1), "metatable");
+          lua_pop(L, 1);
+        }
+        f->kind = F_ARRAY;
+        if (t_completed(f)) {
+          S->nframes--;
+          continue;  /* table is completed */
+        }
+      } else if (f->kind == F_ARRAY) {
+        lua_rawseti(L, -2, f->n++);
+        if (t_completed(f)) {
+          S->nframes--;
+          continue;
+        }
+      } else if (f->kind == F_KEY)
+        f->kind = F_VALUE;
+      else if (f->kind == F_VALUE) {
+        lua_rawset(L, -3);  /* [key] = value */
+        f->total--;
+        f->kind = F_KEY;
+        if (t_completed(f)) {
+          S->nframes--;
+          continue;
+        }
+      } else if (f->kind == F_UPVALUE) {
+        if (lua_setupvalue(L, -2, (int) f->n++) == NULL)
+          lua_pop(L, 1);
+      } else if (f->kind == F_UDNAME) {
+        check(L, lua_type(L, -1) == LUA_TSTRING, "metatable name");
+        if (luaL_getmetatable(L, lua_tostring(L, -1)) != LUA_TTABLE ||
+            lua_getfield(L, -1, "__deserialize") == LUA_TNIL)
+          luaL_error(L, _("cannot deserialize userdata '%s'"), lua_tostring(L, -3));
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+        f->kind = F_UDDATA;
+      } else if (f->kind == F_UDDATA) {
+        lua_call(L, 1, 1);  /* __deserialize(value) */
+        S->nframes--;
+        continue;  /* userdata is completed */
+      } else {
+        /* rows[row][field] = value */
+        lua_rawgeti(L, -3, f->n % f->size + 1);
+        lua_rawgeti(L, -3, f->n / f->size + 1);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+        lua_pop(L, 2);
+        f->n++;
+        if (!r_columns(L, S, f))
+          break;
+        lua_pop(L, 1);  /* remove field names */
+        S->nframes--;
+        continue;  /* records is completed */
+      }
+      break;
+    }
+    if (S->nframes == base)
+      return;
+  }
+}
+
+
+/* push list of references and frames */
+static void r_init (lua_State *L, Stream *S) {
+  lua_newtable(L);
+  S->refs = lua_gettop(L);
+  S->nrefs = 0;
+  S->frames = (Frame *) lua_newuserdata(L, sizeof(Frame) * INITFRAMES);
+  S->nframes = 0;
+  S->framecap = INITFRAMES;
+}
+
+
 LUA_API int lua_deserialize (lua_State *L, int idx) {
   size_t l;
   const char *s = luaL_checklstring(L, idx, &l);
-  /* create hash table */
-  lua_newtable(L);
-  int top = lua_gettop(L);
-  /* deserialize to values */
-  int nresults = deserialize(L, s, s + l, top);
-  /* remove hash table */
+  return lua_deserializebuffer(L, s, l);
+}
+
+
+LUA_API int lua_deserializebuffer (lua_State *L, const char *s, size_t l) {
+  int nresults = 0;
+  if (l > 0 && *s == SIGNATURE) {
+    Stream S;
+    S.s = s + 1;
+    S.e = s + l;
+    S.reader = NULL;
+    /* create list of references and frames */
+    r_init(L, &S);
+    int top = S.refs;
+    /* deserialize to values */
+    for (; S.s < S.e; nresults++)
+      b_deserialize(L, &S);
+    /* remove frames and list of references */
+    lua_remove(L, top + 1);
+    lua_remove(L, top);
+  } else {
+    /* create hash table */
+    lua_newtable(L);
+    int top = lua_gettop(L);
+    /* deserialize to values */
+    nresults = deserialize(L, s, s + l, top);
+    /* remove hash table */
+    lua_remove(L, top);
+  }
+  return nresults;
+}
+
+
+static int sgc (lua_State *L) {
+  Stream *S = (Stream *) lua_touserdata(L, 1);
+  if (S->buf)
+    free(S->buf);
+  return 0;
+}
+
+
+LUA_API int lua_deserializefrom (lua_State *L, lua_Reader reader, void *ud) {
+  /* initialize stream with buffer */
+  Stream *S = (Stream *) lua_newuserdata(L, sizeof(Stream));
+  S->s = S->e = NULL;
+  S->nrefs = 0;
+  S->reader = reader;
+  S->ud = ud;
+  S->buf = NULL;
+  S->bufsize = 0;
+  S->inbuf = 0;
+  if (luaL_newmetatable(L, "StreamReader")) {
+    lua_pushcfunction(L, sgc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  /* create list of references and frames */
+  r_init(L, S);
+  int top = S->refs;
+  /* deserialize to values until end of data */
+  int nresults = 0;
+  if (r_read(L, S)) {
+    check(L, *S->s++ == SIGNATURE, "signature");
+    for (; S->s < S->e || r_read(L, S); nresults++)
+      b_deserialize(L, S);
+  }
+  /* remove frames, list of references and stream */
+  lua_remove(L, top + 1);
   lua_remove(L, top);
+  lua_remove(L, top - 1);
   return nresults;
 }
 
-#endif
\ No newline at end of file
+#endif
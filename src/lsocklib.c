@@ -7,6 +7,13 @@
 #define socklib_c
 #define LUA_LIB
 
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE  /* struct ifreq, h_addr */
+#endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* accept4 */
+#endif
+
 #include "lprefix.h"
 
 #include "lua.h"
@@ -51,6 +58,9 @@
 #ifdef HAVE_WIRELESS_H
 #include <linux/wireless.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include <errno.h>
 #ifndef errno
 extern int errno;
@@ -547,14 +557,14 @@ static int lsocket_ifr (lua_State *L)
 
 static int sock_tcp (lua_State *L)
 {
-  struct socket_t *ctx = (struct socket_t *) lua_newuserdata(L, sizeof(struct socket_t));
+  create(L, SOCKET_TCP, AF_INET, SOCK_STREAM);
+  return 1;
+}
 
-  ctx->type = 0;
-  ctx->handle = socket(AF_INET, SOCK_STREAM, 0);
-  if (ctx->handle < 0)
-    luaL_error(L, _("socket() failed, %s (%d)"), sock_strerror(sock_errno), sock_errno);
-  
-  luaL_setmetatable(L, LUA_SOCKETHANDLE);
+
+static int sock_udp (lua_State *L)
+{
+  create(L, SOCKET_UDP, AF_INET, SOCK_DGRAM);
   return 1;
 }
 
@@ -591,24 +601,37 @@ static int sock_setblocking (lua_State *L)
 }
 
 
-static int sock_connect (lua_State *L)
+/* address and port at idx to sockaddr, '*' is any address */
+static void toaddr (lua_State *L, int idx, struct sockaddr_in *sin)
 {
-  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
-  const char *addr = luaL_checkstring(L, 2);
-  unsigned short port = (unsigned short) luaL_checkinteger(L, 3);
+  const char *addr = luaL_checkstring(L, idx);
+  unsigned short port = (unsigned short) luaL_checkinteger(L, idx + 1);
   
-  struct sockaddr_in sin;
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	sin.sin_addr.s_addr = inet_addr(addr);  /* probe addr by ip */
-  if (sin.sin_addr.s_addr == INADDR_NONE)
+  memset(sin, 0, sizeof(struct sockaddr_in));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+  if (strcmp(addr, "*") == 0)
+  {
+    sin->sin_addr.s_addr = htonl(INADDR_ANY);
+    return;
+  }
+	sin->sin_addr.s_addr = inet_addr(addr);  /* probe addr by ip */
+  if (sin->sin_addr.s_addr == INADDR_NONE)
   {
     struct hostent *host = gethostbyname(addr); /* probe addr by name */
     if (host)
-			memcpy((char *) &sin.sin_addr.s_addr, host->h_addr, sizeof(sin.sin_addr.s_addr));
+			memcpy((char *) &sin->sin_addr.s_addr, host->h_addr, sizeof(sin->sin_addr.s_addr));
 		else
       luaL_error(L, _("unresolve hostname '%s'"), addr);
   }
+}
+
+
+static int sock_connect (lua_State *L)
+{
+  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  struct sockaddr_in sin;
+  toaddr(L, 2, &sin);
   
   /* probe connecting */
   lua_pushboolean(L, (connect(ctx->handle, (struct sockaddr *) &sin, sizeof(struct sockaddr)) == 0));
@@ -616,12 +639,140 @@ static int sock_connect (lua_State *L)
 }
 
 
+static int sock_setopt (lua_State *L, int opt)
+{
+  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  int on = (lua_isnone(L, 2)) ? 1 : lua_toboolean(L, 2);
+  lua_pushboolean(L, setsockopt(ctx->handle, SOL_SOCKET, opt, (const char *) &on, sizeof(on)) == 0);
+  return 1;
+}
+
+
+static int sock_reuseaddr (lua_State *L)
+{
+  return sock_setopt(L, SO_REUSEADDR);
+}
+
+
+static int sock_reuseport (lua_State *L)
+{
+#ifdef SO_REUSEPORT
+  return sock_setopt(L, SO_REUSEPORT);
+#else
+  luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  lua_pushboolean(L, 0);
+  return 1;
+#endif
+}
+
+
+static int sock_bind (lua_State *L)
+{
+  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  struct sockaddr_in sin;
+  toaddr(L, 2, &sin);
+  lua_pushboolean(L, (bind(ctx->handle, (struct sockaddr *) &sin, sizeof(struct sockaddr)) == 0));
+  return 1;
+}
+
+
+static int sock_listen (lua_State *L)
+{
+  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  int backlog = (int) luaL_optinteger(L, 2, SOMAXCONN);
+  lua_pushboolean(L, (listen(ctx->handle, backlog) == 0));
+  return 1;
+}
+
+
+/* local address and port of socket */
+static int sock_addr (lua_State *L)
+{
+  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  struct sockaddr_in sin;
+  socklen_t sinlen = sizeof(sin);
+  if (getsockname(ctx->handle, (struct sockaddr *) &sin, &sinlen) != 0)
+    return 0;
+  lua_pushstring(L, inet_ntoa(sin.sin_addr));
+  lua_pushinteger(L, ntohs(sin.sin_port));
+  return 2;
+}
+
+
+/* no connection yet or accept is interrupted */
+static int acceptagain (int err)
+{
+#ifdef _WIN32
+  return err == WSAEWOULDBLOCK || err == WSAEINTR;
+#else
+  return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+#endif
+}
+
+
+/*
+* accept up to max connections of non-blocking socket, one of blocking socket;
+* nil and message on error if nothing is accepted
+*/
+static int sock_accept (lua_State *L)
+{
+  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  int max = (int) luaL_optinteger(L, 2, 1);
+  luaL_argcheck(L, max > 0, 2, "positive count expected");
+  luaL_checkstack(L, max, "too many connections");
+#ifdef _WIN32
+  max = 1;
+#else
+  int nonblock = (fcntl(ctx->handle, F_GETFL, NULL) & O_NONBLOCK) != 0;
+  if (!nonblock)
+    max = 1;
+#endif
+  int n;
+  for (n = 0; n < max; n++)
+  {
+    struct socket_t *client = (struct socket_t *) lua_newuserdata(L, sizeof(struct socket_t));
+    client->type = ctx->type;
+#ifdef __linux__
+    /* accepted socket inherits non-blocking mode */
+    client->handle = accept4(ctx->handle, NULL, NULL, SOCK_CLOEXEC | ((nonblock) ? SOCK_NONBLOCK : 0));
+#else
+    client->handle = accept(ctx->handle, NULL, NULL);
+#ifndef _WIN32
+    if (client->handle >= 0 && nonblock)
+      fcntl(client->handle, F_SETFL, fcntl(client->handle, F_GETFL, NULL) | O_NONBLOCK);
+#endif
+#endif
+    if (client->handle < 0)
+    {
+      int err = sock_errno;
+      lua_pop(L, 1);
+      if (n > 0 || acceptagain(err))
+        break;
+      /* error is reported if nothing is accepted */
+      lua_pushnil(L);
+      lua_pushstring(L, sock_strerror(err));
+      return 2;
+    }
+    luaL_setmetatable(L, LUA_SOCKETHANDLE);
+  }
+  return n;
+}
+
+
+/* seconds with fraction to timeval */
+static void totimeval (lua_State *L, int idx, struct timeval *tv)
+{
+  lua_Number t = luaL_checknumber(L, idx);
+  tv->tv_sec = (long) t;
+  tv->tv_usec = (long) ((t - (lua_Number) tv->tv_sec) * 1000000);
+}
+
+
 static int sock_select (lua_State *L)
 {
   struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
   struct timeval tv;
-  tv.tv_sec = (int) luaL_checkinteger(L, 2);
-	tv.tv_usec = 0;
+  totimeval(L, 2, &tv);
   fd_set fdset;
   FD_ZERO(&fdset);
   FD_SET(ctx->handle, &fdset);
@@ -643,8 +794,7 @@ static int sock_recvtimeo (lua_State *L)
 {
   struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
   struct timeval tv;
-  tv.tv_sec = (int) luaL_checkinteger(L, 2);
-	tv.tv_usec = 0;
+  totimeval(L, 2, &tv);
   setsockopt(ctx->handle, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(tv));
   return 0;
 }
@@ -653,13 +803,28 @@ static int sock_recvtimeo (lua_State *L)
 static int sock_sendtimeo (lua_State *L) {
   struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
   struct timeval tv;
-  tv.tv_sec = (int) luaL_checkinteger(L, 2);
-	tv.tv_usec = 0;
+  totimeval(L, 2, &tv);
   setsockopt(ctx->handle, SOL_SOCKET, SO_SNDTIMEO, (char *) &tv, sizeof(tv));
   return 0;
 }
 
 
+/*
+* operation of non-blocking socket cannot be completed immediately
+* (timeout of blocking socket is EAGAIN too, it is reported as before)
+*/
+static int wouldblock (struct socket_t *ctx)
+{
+#ifdef _WIN32
+  (void) ctx;
+  return sock_errno == WSAEWOULDBLOCK;
+#else
+  return (sock_errno == EAGAIN || sock_errno == EWOULDBLOCK) &&
+         (fcntl(ctx->handle, F_GETFL, NULL) & O_NONBLOCK) != 0;
+#endif
+}
+
+
 static int sock_recv (lua_State *L)
 {
   struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
@@ -671,6 +836,8 @@ static int sock_recv (lua_State *L)
   int len = recv(ctx->handle, (LPBUFFER) luaL_prepbuffsize(&b, size), size, 0);
   if (len > 0)
     luaL_pushresultsize(&b, (size_t) len);
+  else if (len < 0 && wouldblock(ctx))
+    lua_pushboolean(L, 0);  /* no data yet */
   else
     lua_pushnil(L);
   return 1;
@@ -687,11 +854,57 @@ static int sock_send (lua_State *L)
 }
 
 
+static int sock_sendto (lua_State *L)
+{
+  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  size_t l;
+  const char *s = luaL_checklstring(L, 2, &l);
+  struct sockaddr_in sin;
+  toaddr(L, 3, &sin);
+  lua_pushinteger(L, sendto(ctx->handle, (LPBUFFER) s, l, 0, (struct sockaddr *) &sin, sizeof(struct sockaddr)));
+  return 1;
+}
+
+
+static int sock_recvfrom (lua_State *L)
+{
+  struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
+  size_t size = (size_t) luaL_optinteger(L, 2, MAX_PACKETSIZE);
+  struct sockaddr_in sin;
+  socklen_t sinlen = sizeof(sin);
+  
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  
+  int len = recvfrom(ctx->handle, (LPBUFFER) luaL_prepbuffsize(&b, size), size, 0, (struct sockaddr *) &sin, &sinlen);
+  if (len >= 0)
+  {
+    luaL_pushresultsize(&b, (size_t) len);
+    lua_pushstring(L, inet_ntoa(sin.sin_addr));
+    lua_pushinteger(L, ntohs(sin.sin_port));
+    return 3;
+  }
+  if (wouldblock(ctx))
+    lua_pushboolean(L, 0);  /* no data yet */
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+
+#ifdef __linux__
+static void sock_unpoll (lua_State *L, int idx);
+#endif
+
+
 static int sock_close (lua_State *L)
 {
   struct socket_t *ctx = (struct socket_t *) luaL_checkudata(L, 1, LUA_SOCKETHANDLE);
   if (ctx->handle > 0)
   {
+#ifdef __linux__
+    sock_unpoll(L, 1);
+#endif
     shutdown(ctx->handle, 2);
     close(ctx->handle);
     ctx->handle = -1;
@@ -712,14 +925,235 @@ static int sock_gc (lua_State *L)
 }
 
 
+#ifdef __linux__
+/*
+* Poller of socket events
+*/
+
+#define LUA_POLLERHANDLE "poller"
+#define MAX_POLLEVENTS 256
+
+struct poller_t {
+  int handle;
+  int maxevents;
+  struct epoll_event events[1];
+};
+
+
+static int poller_new (lua_State *L)
+{
+  int maxevents = (int) luaL_optinteger(L, 1, MAX_POLLEVENTS);
+  luaL_argcheck(L, maxevents > 0, 1, "positive count of events expected");
+  struct poller_t *ctx = (struct poller_t *) lua_newuserdata(L, sizeof(struct poller_t) + (maxevents - 1) * sizeof(struct epoll_event));
+  ctx->maxevents = maxevents;
+  ctx->handle = epoll_create1(EPOLL_CLOEXEC);
+  if (ctx->handle < 0)
+    luaL_error(L, _("epoll_create1() failed, %s (%d)"), sock_strerror(sock_errno), sock_errno);
+  luaL_setmetatable(L, LUA_POLLERHANDLE);
+  /* sockets by handles */
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
+/* events of string: r - read, w - write, e - edge triggered, o - one shot */
+static uint32_t poller_events (lua_State *L, int idx)
+{
+  const char *s = luaL_optstring(L, idx, "r");
+  uint32_t events = 0;
+  for (; *s; s++)
+  {
+    switch (*s)
+    {
+      case 'r': events |= EPOLLIN | EPOLLRDHUP; break;
+      case 'w': events |= EPOLLOUT; break;
+      case 'e': events |= EPOLLET; break;
+      case 'o': events |= EPOLLONESHOT; break;
+      default:
+        luaL_argerror(L, idx, _("invalid events"));
+    }
+  }
+  return events;
+}
+
+
+/* remove socket at idx from sockets of poller at pidx and poller from pollers of socket */
+static void poller_forget (lua_State *L, int pidx, int idx)
+{
+  struct socket_t *sock = (struct socket_t *) lua_touserdata(L, idx);
+  lua_getuservalue(L, pidx);
+  lua_rawgeti(L, -1, sock->handle);
+  if (lua_rawequal(L, -1, idx))  /* descriptor is not reused by other socket? */
+  {
+    lua_pushnil(L);
+    lua_rawseti(L, -3, sock->handle);
+  }
+  lua_pop(L, 2);
+  if (lua_getuservalue(L, idx) == LUA_TTABLE)
+  {
+    lua_pushvalue(L, pidx);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+  }
+  lua_pop(L, 1);
+}
+
+
+/* remove socket at idx from all pollers before descriptor is closed */
+static void sock_unpoll (lua_State *L, int idx)
+{
+  struct socket_t *sock = (struct socket_t *) lua_touserdata(L, idx);
+  idx = lua_absindex(L, idx);
+  if (lua_getuservalue(L, idx) == LUA_TTABLE)
+  {
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+      struct poller_t *ctx = (struct poller_t *) lua_touserdata(L, -2);
+      struct epoll_event ev;
+      lua_pop(L, 1);
+      if (ctx->handle >= 0)
+        epoll_ctl(ctx->handle, EPOLL_CTL_DEL, sock->handle, &ev);
+      lua_getuservalue(L, -1);
+      lua_rawgeti(L, -1, sock->handle);
+      if (lua_rawequal(L, -1, idx))
+      {
+        lua_pushnil(L);
+        lua_rawseti(L, -3, sock->handle);
+      }
+      lua_pop(L, 2);
+    }
+  }
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  lua_setuservalue(L, idx);
+}
+
+
+static int poller_ctl (lua_State *L, int op)
+{
+  struct poller_t *ctx = (struct poller_t *) luaL_checkudata(L, 1, LUA_POLLERHANDLE);
+  struct socket_t *sock = (struct socket_t *) luaL_checkudata(L, 2, LUA_SOCKETHANDLE);
+  struct epoll_event ev;
+  ev.events = (op == EPOLL_CTL_DEL) ? 0 : poller_events(L, 3);
+  ev.data.fd = sock->handle;
+  int ok = (epoll_ctl(ctx->handle, op, sock->handle, &ev) == 0);
+  if (op == EPOLL_CTL_DEL)
+    poller_forget(L, 1, 2);  /* even if descriptor is not polled already */
+  else if (ok)
+  {
+    /* keep socket while it is polled */
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, sock->handle);
+    lua_pop(L, 1);
+    /* pollers of socket (weak), to forget socket on close */
+    if (lua_getuservalue(L, 2) != LUA_TTABLE)
+    {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_createtable(L, 0, 1);
+      lua_pushliteral(L, "k");
+      lua_setfield(L, -2, "__mode");
+      lua_setmetatable(L, -2);
+      lua_pushvalue(L, -1);
+      lua_setuservalue(L, 2);
+    }
+    lua_pushvalue(L, 1);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+
+static int poller_add (lua_State *L)
+{
+  return poller_ctl(L, EPOLL_CTL_ADD);
+}
+
+
+static int poller_mod (lua_State *L)
+{
+  return poller_ctl(L, EPOLL_CTL_MOD);
+}
+
+
+static int poller_del (lua_State *L)
+{
+  return poller_ctl(L, EPOLL_CTL_DEL);
+}
+
+
+static int poller_wait (lua_State *L)
+{
+  struct poller_t *ctx = (struct poller_t *) luaL_checkudata(L, 1, LUA_POLLERHANDLE);
+  int timeout = (int) luaL_optinteger(L, 2, -1);
+  int n = epoll_wait(ctx->handle, ctx->events, ctx->maxevents, timeout);
+  if (n < 0)
+  {
+    if (sock_errno != EINTR)
+      luaL_error(L, _("epoll_wait() failed, %s (%d)"), sock_strerror(sock_errno), sock_errno);
+    n = 0;
+  }
+  /* ready sockets with events: r - read, w - write, h - hang up or error */
+  lua_getuservalue(L, 1);
+  lua_createtable(L, 0, n);
+  int i;
+  for (i = 0; i < n; i++)
+  {
+    char events[3];
+    int len = 0;
+    uint32_t ev = ctx->events[i].events;
+    if (ev & EPOLLIN)
+      events[len++] = 'r';
+    if (ev & EPOLLOUT)
+      events[len++] = 'w';
+    if (ev & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+      events[len++] = 'h';
+    if (lua_rawgeti(L, -2, ctx->events[i].data.fd) == LUA_TNIL)
+    {
+      lua_pop(L, 1);
+      continue;
+    }
+    lua_pushlstring(L, events, len);
+    lua_rawset(L, -3);
+  }
+  return 1;
+}
+
+
+static int poller_close (lua_State *L)
+{
+  struct poller_t *ctx = (struct poller_t *) luaL_checkudata(L, 1, LUA_POLLERHANDLE);
+  if (ctx->handle >= 0)
+  {
+    close(ctx->handle);
+    ctx->handle = -1;
+  }
+  /* release polled sockets */
+  lua_newtable(L);
+  lua_setuservalue(L, 1);
+  return 0;
+}
+#endif
+
+
 /*
 ** functions for 'socket' library
 */
 static const luaL_Reg sock_lib[] = {
   {"ifr", lsocket_ifr},
   {"tcp", sock_tcp},
+  {"udp", sock_udp},
   {"err", sock_err},
   {"strerr", sock_strerr},
+#ifdef __linux__
+  {"poller", poller_new},
+#endif
   {NULL, NULL}
 };
 
@@ -739,17 +1173,41 @@ static const luaL_Reg socket_ifr_methods[] = {
 static const luaL_Reg sock_methods[] = {
   {"setblocking", sock_setblocking},
   {"connect", sock_connect},
+  {"reuseaddr", sock_reuseaddr},
+  {"reuseport", sock_reuseport},
+  {"bind", sock_bind},
+  {"listen", sock_listen},
+  {"accept", sock_accept},
+  {"addr", sock_addr},
   {"select", sock_select},
   {"recvtimeo", sock_recvtimeo},
   {"sendtimeo", sock_sendtimeo},
   {"recv", sock_recv},
   {"send", sock_send},
+  {"recvfrom", sock_recvfrom},
+  {"sendto", sock_sendto},
   {"close", sock_close},
   {"__gc", sock_gc},
   {NULL, NULL}
 };
 
 
+#ifdef __linux__
+/*
+** methods for poller handles
+*/
+static const luaL_Reg poller_methods[] = {
+  {"add", poller_add},
+  {"mod", poller_mod},
+  {"del", poller_del},
+  {"wait", poller_wait},
+  {"close", poller_close},
+  {"__gc", poller_close},
+  {NULL, NULL}
+};
+#endif
+
+
 static int sock_call (lua_State *L)
 {
   lua_remove(L, 1);
@@ -785,6 +1243,14 @@ LUAMOD_API int luaopen_socket (lua_State *L) {
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_setfuncs(L, sock_methods, 0);  /* add methods to new metatable */
   lua_pop(L, 1);  /* pop new metatable */
+#ifdef __linux__
+  /* create metatable for poller handles */
+  luaL_newmetatable(L, LUA_POLLERHANDLE);
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, poller_methods, 0);  /* add methods to new metatable */
+  lua_pop(L, 1);  /* pop new metatable */
+#endif
 /*#ifdef _WIN32
 	WSACleanup();
 #endif*/
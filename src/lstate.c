@@ -278,6 +278,10 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
 #endif
 #ifdef LUAEX_THREADLIB
   L1->canceled = L->canceled;
+#endif
+#ifdef LUAEX_MPDECIMAL
+  L1->decctx = L->decctx;
+  L1->maxdecctx = L->maxdecctx;
 #endif
   resethookcount(L1);
   /* initialize L1 extra space */
@@ -378,7 +382,14 @@ LUA_API int lua_getside (lua_State *L) {
 
 
 #ifdef LUAEX_THREADLIB
+/*
+** Cancel is published by flag, then by count bit of hook mask which makes
+** interpreter call 'luaG_traceexec' (raising error when it sees the flag)
+** on every instruction. Hook function of state is kept; 'lua_sethook'
+** keeps the bit while state is canceled.
+*/
 LUA_API void lua_cancel (lua_State *L) {
-  L->canceled = 1;
+  luaE_atomicset(&L->canceled, 1);
+  luaE_atomicor(&L->hookmask, LUA_MASKCOUNT);
 }
 #endif
@@ -70,6 +70,21 @@ struct lua_longjmp;  /* defined in ldo.c */
 #endif
 
 
+#ifdef LUAEX_THREADLIB
+/* atomic access to cancel of state from other native thread (full barrier) */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define luaE_atomicset(x,v)	_InterlockedExchange((volatile long *)(x), (long)(v))
+#define luaE_atomicget(x)	_InterlockedOr((volatile long *)(x), 0)
+#define luaE_atomicor(x,v)	_InterlockedOr((volatile long *)(x), (long)(v))
+#else
+#define luaE_atomicset(x,v)	(__sync_synchronize(), *(x) = (v), __sync_synchronize())
+#define luaE_atomicget(x)	__sync_fetch_and_add(x, 0)
+#define luaE_atomicor(x,v)	__sync_fetch_and_or(x, v)
+#endif
+#endif
+
+
 /* extra stack space to handle TM calls and some other extras */
 #define EXTRA_STACK   5
 
@@ -7,6 +7,10 @@
 #define threadlib_c
 #define LUA_LIB
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* pthread_attr_setaffinity_np, pthread_setname_np */
+#endif
+
 #include "lprefix.h"
 
 #include "lua.h"
@@ -20,6 +24,18 @@
 #include <malloc.h>
 #include <string.h>
 
+/* max number of CPUs in affinity list */
+#define MAXAFFINITY 64
+
+/* attributes of created native thread */
+typedef struct ThreadAttr {
+  size_t stack;  /* stack size, 0 is default */
+  int priority;  /* -2 (lowest) .. 2 (highest), 0 is default */
+  int ncpu;  /* number of CPUs to run on, 0 is any */
+  int cpu[MAXAFFINITY];
+  char name[16];  /* empty is default */
+} ThreadAttr;
+
 #ifdef _WIN32
 /* windows threads */
 #include <windows.h>
@@ -50,12 +66,96 @@ typedef HANDLE THREAD;
 #define COND_broadcast(x) WakeAllConditionVariable(x)
 
 #define THREAD_id() GetCurrentThreadId()
+
+typedef volatile LONG ATOMIC;
+
+#define ATOMIC_inc(x) InterlockedIncrement(x)
+#define ATOMIC_dec(x) InterlockedDecrement(x)
+#define ATOMIC_get(x) InterlockedCompareExchange(x, 0, 0)
+#define ATOMIC_set(x,v) InterlockedExchange(x, v)
+#define ATOMIC_cas(x,o,n) (InterlockedCompareExchange(x, n, o) == (o))
+
+typedef INIT_ONCE ONCE;
+
+#define ONCE_INIT INIT_ONCE_STATIC_INIT
+
+static BOOL CALLBACK ONCE_proc (PINIT_ONCE once, PVOID par, PVOID *ctx) {
+  (void) once; (void) ctx;
+  ((void (*) (void)) par)();
+  return TRUE;
+}
+#define ONCE_call(x,f) InitOnceExecuteOnce(x, ONCE_proc, (PVOID) f, NULL)
+
+/* thread name is not supported */
+static int THREAD_create (THREAD *thread, void *(*proc) (void *), void *par, const ThreadAttr *ta) {
+  SIZE_T stack = (ta && ta->stack) ? (SIZE_T) ta->stack : 0x10000;
+  *thread = CreateThread(NULL, stack, (LPTHREAD_START_ROUTINE) proc, par, CREATE_SUSPENDED, NULL);
+  if (*thread == NULL)
+    return 0;
+  if (ta && ta->ncpu) {
+    DWORD_PTR mask = 0;
+    int i;
+    for (i = 0; i < ta->ncpu; i++) {
+      if (ta->cpu[i] < (int) (sizeof(DWORD_PTR) * 8))
+        mask |= (DWORD_PTR) 1 << ta->cpu[i];
+    }
+    if (mask)
+      SetThreadAffinityMask(*thread, mask);
+  }
+  if (ta && ta->priority)
+    SetThreadPriority(*thread, ta->priority);  /* THREAD_PRIORITY_LOWEST .. THREAD_PRIORITY_HIGHEST */
+  ResumeThread(*thread);
+  return 1;
+}
+
+static void THREAD_join (THREAD thread) {
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+/* monotonic time in milliseconds */
+#define THREAD_clock() ((lua_Integer) GetTickCount64())
+
+/* monotonic time in microseconds */
+static lua_Integer THREAD_uclock (void) {
+  LARGE_INTEGER c, f;
+  QueryPerformanceCounter(&c);
+  QueryPerformanceFrequency(&f);
+  return (lua_Integer) (c.QuadPart / f.QuadPart * 1000000 + c.QuadPart % f.QuadPart * 1000000 / f.QuadPart);
+}
+
+static int THREAD_ncpu (void) {
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return (int) si.dwNumberOfProcessors;
+}
+
+/* manual reset event, has no descriptor */
+typedef HANDLE EVENT;
+
+#define EVENT_init(x) ((*(x) = CreateEvent(NULL, TRUE, FALSE, NULL)) != NULL)
+#define EVENT_destroy(x) CloseHandle(*(x))
+#define EVENT_signal(x) SetEvent(*(x))
+#define EVENT_clear(x) ResetEvent(*(x))
+#define EVENT_wait(x,msec) (WaitForSingleObject(*(x), ((msec) < 0) ? INFINITE : (DWORD) (msec)) == WAIT_OBJECT_0)
+#define EVENT_fd(x) (-1)
 /* windows EOF */
 #else
 /* posix threads */
 #include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 
 typedef pthread_mutex_t MUTEX;
 typedef pthread_cond_t COND;
@@ -77,7 +177,7 @@ static void MUTEX_init (MUTEX *mutex) {
 #define COND_init(x) pthread_cond_init(x, NULL)
 #define COND_destroy(x) pthread_cond_destroy(x)
 
-#define COND_wait(x,y) pthread_cond_wait(x, y);
+#define COND_wait(x,y) pthread_cond_wait(x, y)
 static int COND_waitfor (COND *cond, MUTEX *mutex, unsigned long msec) {
   struct timespec ts;
 	clock_gettime(CLOCK_REALTIME, &ts);
@@ -93,446 +193,3578 @@ static int COND_waitfor (COND *cond, MUTEX *mutex, unsigned long msec) {
 #define COND_broadcast(x) pthread_cond_broadcast(x)
 
 #define THREAD_id() pthread_self()
+
+typedef volatile long ATOMIC;
+
+#define ATOMIC_inc(x) __sync_add_and_fetch(x, 1)
+#define ATOMIC_dec(x) __sync_sub_and_fetch(x, 1)
+#define ATOMIC_get(x) __sync_fetch_and_add(x, 0)
+#define ATOMIC_set(x,v) (__sync_synchronize(), *(x) = (v), __sync_synchronize())
+#define ATOMIC_cas(x,o,n) __sync_bool_compare_and_swap(x, o, n)
+
+typedef pthread_once_t ONCE;
+
+#define ONCE_INIT PTHREAD_ONCE_INIT
+#define ONCE_call(x,f) pthread_once(x, f)
+
+#ifdef __linux__
+typedef struct ThreadStart {
+  void *(*proc) (void *);
+  void *par;
+  int priority;
+} ThreadStart;
+
+
+/* set priority as nice value of new thread (raising needs privilege) */
+static void* THREAD_start (void *par) {
+  ThreadStart start = *(ThreadStart *) par;
+  free(par);
+  setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), -5 * start.priority);
+  return start.proc(start.par);
+}
+#endif
+
+
+/* affinity, priority and name is supported on linux only */
+static int THREAD_create (THREAD *thread, void *(*proc) (void *), void *par, const ThreadAttr *ta) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  if (ta && ta->stack)
+    pthread_attr_setstacksize(&attr, (ta->stack < (size_t) PTHREAD_STACK_MIN) ? (size_t) PTHREAD_STACK_MIN : ta->stack);
+#ifdef __linux__
+  if (ta && ta->ncpu) {
+    cpu_set_t set;
+    int i;
+    CPU_ZERO(&set);
+    for (i = 0; i < ta->ncpu; i++)
+      CPU_SET(ta->cpu[i], &set);
+    pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  }
+  if (ta && ta->priority) {
+    ThreadStart *start = (ThreadStart *) malloc(sizeof(ThreadStart));
+    if (start == NULL) {
+      pthread_attr_destroy(&attr);
+      return 0;
+    }
+    start->proc = proc;
+    start->par = par;
+    start->priority = ta->priority;
+    proc = THREAD_start;
+    par = start;
+  }
+#endif
+  int res = (pthread_create(thread, &attr, proc, par) == 0);
+  pthread_attr_destroy(&attr);
+#ifdef __linux__
+  if (!res && ta && ta->priority)
+    free(par);
+  if (res && ta && ta->name[0])
+    pthread_setname_np(*thread, ta->name);
+#endif
+  return res;
+}
+
+#define THREAD_join(x) pthread_join(x, NULL)
+
+/* monotonic time in milliseconds */
+static lua_Integer THREAD_clock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (lua_Integer) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* monotonic time in microseconds */
+static lua_Integer THREAD_uclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (lua_Integer) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int THREAD_ncpu (void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (int) n : 1;
+}
+
+/* event is eventfd on linux or pipe, readable while signaled */
+typedef struct EVENT {
+  int fd[2];  /* read and write ends */
+} EVENT;
+
+static int EVENT_init (EVENT *e) {
+#ifdef __linux__
+  e->fd[0] = e->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return (e->fd[0] >= 0);
+#else
+  int i;
+  if (pipe(e->fd) != 0)
+    return 0;
+  for (i = 0; i < 2; i++) {
+    fcntl(e->fd[i], F_SETFL, fcntl(e->fd[i], F_GETFL) | O_NONBLOCK);
+    fcntl(e->fd[i], F_SETFD, FD_CLOEXEC);
+  }
+  return 1;
+#endif
+}
+
+static void EVENT_destroy (EVENT *e) {
+  close(e->fd[0]);
+  if (e->fd[1] != e->fd[0])
+    close(e->fd[1]);
+}
+
+static void EVENT_signal (EVENT *e) {
+#ifdef __linux__
+  uint64_t one = 1;
+  ssize_t res = write(e->fd[1], &one, sizeof(one));
+#else
+  ssize_t res = write(e->fd[1], "", 1);
+#endif
+  (void) res;  /* already signaled if full */
+}
+
+static void EVENT_clear (EVENT *e) {
+  char buf[64];
+  while (read(e->fd[0], buf, sizeof(buf)) > 0) ;
+}
+
+static int EVENT_wait (EVENT *e, lua_Integer msec) {
+  struct pollfd p;
+  p.fd = e->fd[0];
+  p.events = POLLIN;
+  p.revents = 0;
+  return (poll(&p, 1, (msec < 0) ? -1 : (int) msec) > 0);
+}
+
+#define EVENT_fd(x) ((x)->fd[0])
 /* posix EOF  */
 #endif
 
 
+
+
 #define LUA_THREADHANDLE "THREAD*"
 #define LUA_POOLHANDLE "POOL*"
+#define LUA_CHANNELHANDLE "CHANNEL*"
+#define LUA_SHAREDHANDLE "SHARED*"
+#define LUA_TEMPLATEHANDLE "TEMPLATE*"
+#define LUA_ASYNCHANDLE "ASYNC*"
+#define LUA_TIMERHANDLE "TIMER*"
 
 #define LUA_THREAD_USERDATA "_THREAD"
+#define LUA_WORKER_USERDATA "_WORKER"
+#define LUA_POOL_USERDATA "_POOL"
+#define LUA_ASYNC_USERDATA "_ASYNC"
+
+/* buckets of latency histogram: 4 per power of 2 microseconds */
+#define NBUCKETS 160
+
+/* chunks per worker of map, reduce and foreach by default */
+#define CHUNKSPERWORKER 4
+
+/* max nested tasks executed by worker while joining */
+#define MAXHELP 16
+
+/* interval to check cancel of task blocked by channel (milliseconds) */
+#define CHECKCANCEL 100
+
+/* number of independently locked shards of shared table */
+#define NSHARDS 16
+
+
+/*
+** Objects shared between states, found by id (or name) while referenced.
+** Serialized handle holds a reference (counted in npending) until some
+** deserialization adopts it, so object outlives handle it was made from
+*/
+typedef struct SharedObject {
+  struct SharedObject *next;
+  lua_Integer id;
+  int nref;
+  int npending;  /* references held by serialized handles */
+  char *name;  /* NULL for anonymous object */
+} SharedObject;
+
+
+static ONCE shared_once = ONCE_INIT;
+static MUTEX shared_mutex;
+static SharedObject *shared_list = NULL;
+static lua_Integer shared_lastid = 0;
+
+
+static void shared_init (void) {
+  MUTEX_init(&shared_mutex);
+}
+
+
+static void shared_register (SharedObject *o) {
+  ONCE_call(&shared_once, shared_init);
+  MUTEX_lock(&shared_mutex);
+  o->id = ++shared_lastid;
+  o->nref = 1;
+  o->npending = 0;
+  o->name = NULL;
+  o->next = shared_list;
+  shared_list = o;
+  MUTEX_unlock(&shared_mutex);
+}
+
+
+/*
+** Register object o with name (copied) unless object with same name
+** already exists, return acquired existing object or o
+*/
+static SharedObject * shared_registername (SharedObject *o, const char *name) {
+  SharedObject *p;
+  ONCE_call(&shared_once, shared_init);
+  MUTEX_lock(&shared_mutex);
+  for (p = shared_list; p; p = p->next) {
+    if (p->name && strcmp(p->name, name) == 0) {
+      p->nref++;
+      MUTEX_unlock(&shared_mutex);
+      return p;
+    }
+  }
+  if (o) {
+    o->id = ++shared_lastid;
+    o->nref = 1;
+    o->npending = 0;
+    o->name = strdup(name);
+    o->next = shared_list;
+    shared_list = o;
+  }
+  MUTEX_unlock(&shared_mutex);
+  return o;
+}
+
+
+/*
+** Find object by id for deserialized handle: adopt reference held by
+** serialized handle if any left, else acquire new one (same payload
+** deserialized again while object is still alive)
+*/
+static SharedObject * shared_acquire (lua_Integer id) {
+  SharedObject *o;
+  ONCE_call(&shared_once, shared_init);
+  MUTEX_lock(&shared_mutex);
+  for (o = shared_list; o; o = o->next) {
+    if (o->id == id) {
+      if (o->npending > 0)
+        o->npending--;
+      else
+        o->nref++;
+      break;
+    }
+  }
+  MUTEX_unlock(&shared_mutex);
+  return o;
+}
+
+
+static void shared_retain (SharedObject *o) {
+  MUTEX_lock(&shared_mutex);
+  o->nref++;
+  MUTEX_unlock(&shared_mutex);
+}
+
+
+/* take reference for serialized handle, return id to serialize */
+static lua_Integer shared_serialize (SharedObject *o) {
+  MUTEX_lock(&shared_mutex);
+  o->nref++;
+  o->npending++;
+  MUTEX_unlock(&shared_mutex);
+  return o->id;
+}
+
+
+/* return true if last reference released */
+static int shared_release (SharedObject *o) {
+  MUTEX_lock(&shared_mutex);
+  int last = (--o->nref == 0);
+  if (last) {
+    SharedObject **p = &shared_list;
+    while (*p != o)
+      p = &(*p)->next;
+    *p = o->next;
+    free(o->name);
+    o->name = NULL;
+  }
+  MUTEX_unlock(&shared_mutex);
+  return last;
+}
+
+
+static int pushbuffer (lua_State *L) {
+  lua_pushlstring(L, (const char *) lua_touserdata(L, 1), (size_t) lua_tointeger(L, 2));
+  return 1;
+}
+
+
+/*
+** Push string of malloc'ed data and free data, also when push raises
+** error (caller ensures stack space for 3 values)
+*/
+static void pushfree (lua_State *L, char *data, size_t size) {
+  lua_pushcfunction(L, pushbuffer);
+  lua_pushlightuserdata(L, data);
+  lua_pushinteger(L, (lua_Integer) size);
+  int status = lua_pcall(L, 2, 1, 0);
+  free(data);
+  if (status != LUA_OK)
+    lua_error(L);
+}
+
+
+typedef struct ThreadState ThreadState;
+typedef struct PoolState PoolState;
+
+
+/*
+** Template of states: libraries opened and init function called once per
+** state ahead of time, ready states are cached for new threads and workers
+*/
+typedef struct Template {
+  SharedObject obj;
+  MUTEX mutex;
+  char *var;  /* serialized init function and arguments or NULL */
+  size_t varsize;
+  lua_State **states;  /* ready states */
+  int nstates;
+  int size;  /* max number of ready states */
+} Template;
+
+
+static void tpl_release (Template *tpl) {
+  if (tpl && shared_release(&tpl->obj)) {
+    int i;
+    for (i = 0; i < tpl->nstates; i++)
+      lua_close(tpl->states[i]);
+    free(tpl->states);
+    free(tpl->var);
+    MUTEX_destroy(&tpl->mutex);
+    free(tpl);
+  }
+}
 
 
-typedef struct PoolState {
+/*
+** Waiting for any of several tasks, signaled by first completed
+*/
+typedef struct Waiter {
   MUTEX mutex;
   COND cond;
-  int nref;
-  int *ref;
-  size_t refsize;
-} PoolState;
+  int signaled;
+} Waiter;
 
 
-typedef struct ThreadState {
-  lua_State *L;
-  char *var;
+typedef struct WaitNode {
+  Waiter *w;
+  ThreadState *ts;
+  struct WaitNode *prev;
+  struct WaitNode *next;
+} WaitNode;
+
+
+/*
+** Completion queue of async tasks of one state, event is signaled while
+** queue is not empty
+*/
+typedef struct AsyncQueue {
+  MUTEX mutex;
+  EVENT event;
+  ThreadState *head;  /* completed tasks */
+  ThreadState *tail;
+  int closed;  /* owner state is closed */
+  int nref;  /* owner state and pending tasks */
+  int pending;  /* tasks not resumed yet (used by owner state only) */
+} AsyncQueue;
+
+
+static void aq_release (AsyncQueue *aq) {
+  MUTEX_lock(&aq->mutex);
+  int nref = --aq->nref;
+  MUTEX_unlock(&aq->mutex);
+  if (nref == 0) {
+    EVENT_destroy(&aq->event);
+    MUTEX_destroy(&aq->mutex);
+    free(aq);
+  }
+}
+
+
+/*
+** Results of task moved to joiner as one block: nil, boolean, number and
+** string values are stored as is (strings are copied once, without text
+** encoding), other values are serialized together to keep shared references.
+*/
+#define RESULT_SERIALIZED (-2)
+
+typedef struct ResultValue {
+  int type;  /* basic type or RESULT_SERIALIZED */
+  int isint;
+  lua_Integer i;  /* integer or boolean */
+  lua_Number n;
+  size_t size;  /* size of string data */
+} ResultValue;
+
+
+typedef struct Results {
+  int n;  /* number of values, followed by values and data */
+  size_t size;  /* size of serialized values data */
+  size_t bytes;  /* size of block */
+} Results;
+
+
+#define resvalues(r) ((ResultValue *) ((r) + 1))
+
+
+/*
+** Task executed by own native thread (thread.new) or by pool worker.
+** Shared by the Lua handle and the pool, freed by last reference.
+*/
+struct ThreadState {
+  lua_State *L;  /* executing state or NULL */
+  char *var;  /* serialized function and arguments */
   size_t varsize;
+  char *res;  /* results (Results block) or error message */
+  size_t ressize;
   int status;
-#ifdef _WIN32
-  DWORD threadId;
-#endif
-  THREAD thread;
-  volatile int running;
+  lua_Integer id;  /* executing thread id */
+  THREAD thread;  /* own native thread */
+  int joinable;  /* own native thread is not joined */
+  volatile int running;  /* queued or executing */
   volatile int interrupted;
+  volatile int canceled;
+  int nref;
   MUTEX mutex;
   COND cond;
+  WaitNode *waiters;  /* wait_any callers */
   PoolState *ps;
-} ThreadState;
+  Template *tpl;  /* template of own state or NULL */
+  lua_CFunction proc;  /* called with function and arguments or NULL */
+  AsyncQueue *aq;  /* completion queue of async task or NULL */
+  ThreadState *anext;  /* link in completion queue */
+  lua_Integer queued;  /* time of submit (microseconds) */
+  ThreadState *prev;  /* links in worker deque */
+  ThreadState *next;  /* or outer task executed by worker */
+};
 
 
-static int thread_call (lua_State *L) {
-  ThreadState *ts = (ThreadState *) lua_touserdata(L, 1);
-  /* initialize state */
-  luaL_openlibs(L);
-  lua_pushlightuserdata(L, ts);
-  lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);
-  /* deserialize variables */
-  lua_pushlstring(L, ts->var, ts->varsize);
-  int top = lua_gettop(L);
-  int nvars = lua_deserialize(L, -1);
-  lua_remove(L, top);
-  /* calling function */
-  top = lua_gettop(L);
-  lua_call(L, nvars - 1, LUA_MULTRET);
-  int nresults = lua_gettop(L) - top + nvars;
-  /* serialize results */
-  if (nresults > 0)
-    lua_serialize(L, -(nresults), -1);
-  else
-    lua_pushnil(L);
-  return 1;
-}
+/*
+** Long-lived pool thread with own state and deque of tasks.
+** Owner pushes and pops tasks at tail, idle workers steal from head.
+*/
+typedef struct Worker {
+  MUTEX mutex;  /* protects deque and task */
+  ThreadState *head;
+  ThreadState *tail;
+  ThreadState *task;  /* executing task (innermost) */
+  int depth;  /* number of nested executing tasks */
+  int idx;
+  THREAD thread;
+  lua_State *L;
+  PoolState *ps;
+  /* statistics, written by worker only and read without lock */
+  volatile lua_Integer completed;
+  volatile lua_Integer busy;  /* microseconds */
+  volatile lua_Integer bytesin;  /* serialized function and arguments */
+  volatile lua_Integer bytesout;  /* results or error messages */
+  volatile lua_Integer wait[NBUCKETS];  /* histogram of queue wait */
+  volatile lua_Integer runtime[NBUCKETS];  /* histogram of run time */
+} Worker;
 
 
-static void* thread_proc (void *par) {
-  ThreadState *ts = (ThreadState *) par;
-  /* todo something */
-  lua_pushcfunction(ts->L, thread_call);
-  lua_pushlightuserdata(ts->L, ts);
-  ts->status = lua_pcall(ts->L, 1, 1, 0);
-  /* running = false */
+/*
+** Timer of pool: serialized function and arguments queued to pool when
+** due, periodic timer is scheduled again. Timers are kept in min-heap by
+** due time and shared by heap and Lua handle.
+*/
+typedef struct Timer {
+  lua_Integer due;  /* milliseconds of THREAD_clock */
+  lua_Integer period;  /* 0 for one shot timer */
+  lua_Integer count;  /* number of queued calls */
+  char *var;
+  size_t varsize;
+  int pos;  /* index in heap or -1 */
+  int nref;
+} Timer;
+
+
+/* admission policies of pool with bounded queue */
+enum { POLICY_BLOCK, POLICY_FAIL, POLICY_CALLER };
+
+static const char *const policies[] = {"block", "fail", "caller", NULL};
+
+
+struct PoolState {
+  SharedObject obj;
+  MUTEX mutex;
+  COND cond;  /* task queued or pool closing */
+  COND done;  /* all tasks completed */
+  ATOMIC nref;  /* queued and executing tasks */
+  ATOMIC nqueued;  /* tasks in deques */
+  ATOMIC nblocked;  /* callers waiting for space in deques */
+  COND space;  /* task taken from deque */
+  int maxqueued;  /* max number of queued tasks, 0 is unbounded */
+  int policy;  /* admission policy when queue is full */
+  int keep;  /* keep handles of finished tasks */
+  MUTEX tmutex;  /* protects timers */
+  COND tcond;  /* timer added or pool closing */
+  Timer **timers;  /* min-heap of scheduled timers */
+  int ntimers;
+  int timercap;
+  THREAD timer;  /* timer thread */
+  int hastimer;  /* timer thread is started */
+  ATOMIC nidle;  /* sleeping workers */
+  ATOMIC next;  /* round-robin worker for external tasks */
+  volatile int stopping;  /* owner is collected: timers stopped (tmutex) */
+  volatile int closing;
+  Worker *workers;
+  int nworkers;
+  Template *tpl;  /* template of worker states or NULL */
+};
+
+
+/*
+** Pool handle; only handle created pool closes it
+*/
+typedef struct PoolHandle {
+  PoolState *ps;
+  int owner;
+  int *ref;  /* added tasks */
+  size_t refsize;
+  size_t refcap;
+} PoolHandle;
+
+
+#define tothread(L,idx) (*(ThreadState **) luaL_checkudata(L, idx, LUA_THREADHANDLE))
+#define topool(L,idx) ((PoolHandle *) luaL_checkudata(L, idx, LUA_POOLHANDLE))
+
+
+static void release (ThreadState *ts) {
   MUTEX_lock(&ts->mutex);
-  ts->running = 0;
+  int nref = --ts->nref;
   MUTEX_unlock(&ts->mutex);
-  if (ts->ps) {
-    PoolState *ps = ts->ps;
-    MUTEX_lock(&ps->mutex);
-    ps->nref--;
-    COND_broadcast(&ps->cond);
-    MUTEX_unlock(&ps->mutex);
+  if (nref == 0) {
+    MUTEX_destroy(&ts->mutex);
+    COND_destroy(&ts->cond);
+    if (ts->var)
+      free(ts->var);
+    if (ts->res)
+      free(ts->res);
+    tpl_release(ts->tpl);
+    if (ts->aq)
+      aq_release(ts->aq);
+    free(ts);
   }
-  return NULL;
 }
 
 
-static ThreadState * create (lua_State *L, int idx, PoolState *ps) {
-  luaL_checktype(L, idx, LUA_TFUNCTION);
-  int count = lua_gettop(L);
-  ThreadState *ts = (ThreadState *) lua_newuserdata(L, sizeof(ThreadState));
-  ts->L = luaL_newstate();
-  if (ts->L == NULL)
-    luaL_error(L, _("cannot create state: not enough memory"));
-  ts->var = NULL;
-  ts->varsize = 0;
-  ts->status = 1;
-#ifdef _WIN32
-  ts->threadId = 0;
-  ts->thread = NULL;
-#endif
-  ts->running = 0;
-  ts->interrupted = 0;
-  ts->ps = ps;
-  MUTEX_init(&ts->mutex);
-  COND_init(&ts->cond);
-  luaL_setmetatable(L, LUA_THREADHANDLE);
-  /* serialize variables */
-  lua_serialize(L, idx, count);
-  const char *s = lua_tolstring(L, -1, &ts->varsize);
-  ts->var = (char *) malloc(sizeof(char) * ts->varsize);
-  if (ts->var == NULL)
-    luaL_error(L, _("not enough memory"));
-  memcpy(ts->var, s, ts->varsize);
-  lua_pop(L, 1);
-  /* create thread */
+static void interrupt (ThreadState *ts) {
   MUTEX_lock(&ts->mutex);
-#ifdef _WIN32
-  ts->thread = CreateThread(NULL, 0x10000, (LPTHREAD_START_ROUTINE) thread_proc, ts, 0, &ts->threadId);
-  ts->running = (ts->thread != NULL);
-#else
-  pthread_attr_t attr;
-  pthread_attr_init(&attr);
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-  ts->running = (pthread_create(&ts->thread, &attr, thread_proc, ts) == 0);
-  pthread_attr_destroy(&attr);
-#endif
-  if (!ts->running) {
-    MUTEX_unlock(&ts->mutex);
-    luaL_error(L, _("cannot create thread"));
+  ts->interrupted = 1;
+  COND_broadcast(&ts->cond);
+  MUTEX_unlock(&ts->mutex);
+}
+
+
+static void cancel (ThreadState *ts) {
+  MUTEX_lock(&ts->mutex);
+  ts->canceled = 1;
+  if (ts->L)
+    lua_cancel(ts->L);
+  COND_broadcast(&ts->cond);
+  MUTEX_unlock(&ts->mutex);
+}
+
+
+static int openlibs (lua_State *L) {
+  Template *tpl = (Template *) lua_touserdata(L, 1);
+  luaL_openlibs(L);
+  if (tpl && tpl->var) {  /* call init function */
+    lua_pushlstring(L, tpl->var, tpl->varsize);
+    int top = lua_gettop(L);
+    int nvars = lua_deserialize(L, -1);
+    lua_remove(L, top);
+    lua_call(L, nvars - 1, 0);
+  }
+  return 0;
+}
+
+
+/*
+** New state with opened libraries (initialized by template tpl),
+** on error push message to 'from' (if not NULL) and return NULL
+*/
+static lua_State * newstate (Template *tpl, lua_State *from) {
+  lua_State *L = luaL_newstate();
+  if (L == NULL) {
+    if (from)
+      lua_pushstring(from, _("cannot create state: not enough memory"));
+    return NULL;
+  }
+  lua_pushcfunction(L, openlibs);
+  lua_pushlightuserdata(L, tpl);
+  if (lua_pcall(L, 1, 0, 0)) {
+    if (from) {
+      const char *msg = lua_tostring(L, -1);
+      lua_pushstring(from, (msg) ? msg : _("error object is not a string"));
+    }
+    lua_close(L);
+    L = NULL;
+  }
+  return L;
+}
+
+
+/* take ready state of template or create new one */
+static lua_State * tpl_take (Template *tpl) {
+  lua_State *L = NULL;
+  MUTEX_lock(&tpl->mutex);
+  if (tpl->nstates > 0)
+    L = tpl->states[--tpl->nstates];
+  MUTEX_unlock(&tpl->mutex);
+  return (L) ? L : newstate(tpl, NULL);
+}
+
+
+/* put ready state L to template, return false if template is full */
+static int tpl_put (Template *tpl, lua_State *L) {
+  MUTEX_lock(&tpl->mutex);
+  int res = (tpl->nstates < tpl->size);
+  if (res)
+    tpl->states[tpl->nstates++] = L;
+  MUTEX_unlock(&tpl->mutex);
+  return res;
+}
+
+
+/* create ready states until template is full */
+static void tpl_fill (Template *tpl) {
+  for (;;) {
+    MUTEX_lock(&tpl->mutex);
+    int full = (tpl->nstates >= tpl->size);
+    MUTEX_unlock(&tpl->mutex);
+    if (full)
+      return;
+    lua_State *L = newstate(tpl, NULL);
+    if (L == NULL)
+      return;
+    if (!tpl_put(tpl, L)) {
+      lua_close(L);
+      return;
+    }
+  }
+}
+
+
+static int setworker (lua_State *L) {
+  lua_pushvalue(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_WORKER_USERDATA);
+  return 0;
+}
+
+
+/* state of pool worker w */
+static lua_State * workerstate (Worker *w) {
+  lua_State *L = (w->ps->tpl) ? tpl_take(w->ps->tpl) : newstate(NULL, NULL);
+  if (L) {
+    lua_pushcfunction(L, setworker);
+    lua_pushlightuserdata(L, w);
+    if (lua_pcall(L, 1, 0, 0)) {
+      lua_close(L);
+      L = NULL;
+    }
+  }
+  return L;
+}
+
+
+/* current task is canceled */
+static int iscanceled (lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);
+  ThreadState *ts = (ThreadState *) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return ts && ts->canceled;
+}
+
+
+/* worker of pool executing in state L or NULL */
+static Worker * getworker (lua_State *L, PoolState *ps) {
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_WORKER_USERDATA);
+  Worker *w = (Worker *) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return (w && w->ps == ps) ? w : NULL;
+}
+
+
+static int isplain (int type) {
+  return type == LUA_TNIL || type == LUA_TBOOLEAN || type == LUA_TNUMBER || type == LUA_TSTRING;
+}
+
+
+/* store n values from idx to new Results block */
+static Results * results (lua_State *L, int idx, int n) {
+  int i, top = lua_gettop(L);
+  size_t l, size = sizeof(Results) + sizeof(ResultValue) * n, serialized = 0;
+  /* serialize values which is not plain together */
+  luaL_checkstack(L, n + 1, NULL);
+  for (i = 0; i < n; i++) {
+    int type = lua_type(L, idx + i);
+    if (isplain(type)) {
+      if (type == LUA_TSTRING)
+        size += lua_rawlen(L, idx + i);
+    } else
+      lua_pushvalue(L, idx + i);
+  }
+  if (lua_gettop(L) > top) {
+    lua_serialize(L, top + 1, lua_gettop(L));
+    lua_replace(L, top + 1);
+    lua_settop(L, top + 1);
+    serialized = lua_rawlen(L, top + 1);
+    size += serialized;
+  }
+  Results *r = (Results *) malloc(size);
+  if (r == NULL)
+    luaL_error(L, _("not enough memory"));
+  r->n = n;
+  r->bytes = size;
+  r->size = serialized;
+  ResultValue *v = resvalues(r);
+  char *data = (char *) (v + n);
+  if (serialized) {
+    memcpy(data, lua_tostring(L, top + 1), serialized);
+    data += serialized;
+  }
+  for (i = 0; i < n; i++, v++) {
+    v->type = lua_type(L, idx + i);
+    v->size = 0;
+    switch (v->type) {
+      case LUA_TBOOLEAN:
+        v->i = lua_toboolean(L, idx + i);
+        break;
+      case LUA_TNUMBER:
+        v->isint = lua_isinteger(L, idx + i);
+        if (v->isint)
+          v->i = lua_tointeger(L, idx + i);
+        else
+          v->n = lua_tonumber(L, idx + i);
+        break;
+      case LUA_TSTRING: {
+        const char *s = lua_tolstring(L, idx + i, &l);
+        memcpy(data, s, l);
+        data += l;
+        v->size = l;
+        break;
+      }
+      case LUA_TNIL:
+        break;
+      default:
+        v->type = RESULT_SERIALIZED;
+    }
+  }
+  lua_settop(L, top);
+  return r;
+}
+
+
+/* push values of Results block, return number of values */
+static int pushresults (lua_State *L, Results *r) {
+  int i, base = lua_gettop(L);
+  ResultValue *v = resvalues(r);
+  const char *data = (const char *) (v + r->n);
+  luaL_checkstack(L, r->n + 1, NULL);
+  if (r->size) {  /* deserialize not plain values first */
+    lua_pushlstring(L, data, r->size);
+    lua_deserialize(L, -1);
+    lua_remove(L, base + 1);
+    data += r->size;
+  }
+  int serialized = base + 1;
+  lua_pushboolean(L, 1);
+  for (i = 0; i < r->n; i++, v++) {
+    switch (v->type) {
+      case LUA_TBOOLEAN:
+        lua_pushboolean(L, (int) v->i);
+        break;
+      case LUA_TNUMBER:
+        if (v->isint)
+          lua_pushinteger(L, v->i);
+        else
+          lua_pushnumber(L, v->n);
+        break;
+      case LUA_TSTRING:
+        lua_pushlstring(L, data, v->size);
+        data += v->size;
+        break;
+      case RESULT_SERIALIZED:
+        lua_pushvalue(L, serialized++);
+        break;
+      default:
+        lua_pushnil(L);
+    }
+  }
+  return r->n + 1;
+}
+
+
+static int thread_call (lua_State *L) {
+  ThreadState *ts = (ThreadState *) lua_touserdata(L, 1);
+  /* initialize state (pool workers and template states are initialized ahead) */
+  if (ts->ps == NULL && ts->tpl == NULL)
+    luaL_openlibs(L);
+  lua_pushlightuserdata(L, ts);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);
+  /* deserialize variables */
+  lua_pushlstring(L, ts->var, ts->varsize);
+  int top = lua_gettop(L);
+  int nvars = lua_deserialize(L, -1);
+  lua_remove(L, top);
+  /* calling function */
+  top = lua_gettop(L);
+  if (ts->proc) {  /* call proc(f, ...) */
+    lua_pushcfunction(L, ts->proc);
+    lua_insert(L, top - nvars + 1);
+    nvars++;
+    top++;
+  }
+  lua_call(L, nvars - 1, LUA_MULTRET);
+  int nresults = lua_gettop(L) - top + nvars;
+  /* move results out of state */
+  if (nresults > 0)
+    lua_pushlightuserdata(L, results(L, lua_gettop(L) - nresults + 1, nresults));
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+
+/*
+** Run task in own coroutine, so cancel does not break executing state
+** and task can be executed by worker while joining other task
+*/
+static int task_call (lua_State *L) {
+  ThreadState *ts = (ThreadState *) lua_touserdata(L, 1);
+  lua_State *co = lua_newthread(L);
+  MUTEX_lock(&ts->mutex);
+  if (ts->canceled) {
+    MUTEX_unlock(&ts->mutex);
+    return luaL_error(L, _("canceled"));
+  }
+  ts->L = co;
+  ts->id = (lua_Integer) THREAD_id();
+  MUTEX_unlock(&ts->mutex);
+  lua_pushcfunction(co, thread_call);
+  lua_pushlightuserdata(co, ts);
+  int status = lua_pcall(co, 1, 1, 0);
+  MUTEX_lock(&ts->mutex);
+  ts->L = NULL;
+  MUTEX_unlock(&ts->mutex);
+  lua_pushinteger(L, status);
+  lua_xmove(co, L, 1);
+  return 2;
+}
+
+
+/* put completed async task to its queue (queue owns reference to task) */
+static void aq_complete (ThreadState *ts) {
+  AsyncQueue *aq = ts->aq;
+  MUTEX_lock(&aq->mutex);
+  int closed = aq->closed;
+  if (!closed) {
+    if (aq->tail)
+      aq->tail->anext = ts;
+    else
+      aq->head = ts;
+    aq->tail = ts;
+    EVENT_signal(&aq->event);
+  }
+  MUTEX_unlock(&aq->mutex);
+  if (closed)
+    release(ts);
+}
+
+
+/* store results block r (or copy of error message) and wake up joiners */
+static void finish (ThreadState *ts, int status, const char *s, size_t l, Results *r) {
+  WaitNode *node;
+  char *res = (char *) r;
+  if (s) {
+    res = (char *) malloc(sizeof(char) * (l + 1));
+    if (res)
+      memcpy(res, s, l);
+    else if (status == LUA_OK)
+      status = LUA_ERRMEM;
+  }
+  MUTEX_lock(&ts->mutex);
+  ts->status = status;
+  ts->res = res;
+  ts->ressize = (res) ? l : 0;
+  ts->L = NULL;
+  ts->running = 0;
+  COND_broadcast(&ts->cond);
+  for (node = ts->waiters; node; node = node->next) {
+    MUTEX_lock(&node->w->mutex);
+    node->w->signaled = 1;
+    COND_broadcast(&node->w->cond);
+    MUTEX_unlock(&node->w->mutex);
   }
   MUTEX_unlock(&ts->mutex);
+  if (ts->aq)
+    aq_complete(ts);
+}
+
+
+static void execute (lua_State *L, ThreadState *ts) {
+  int top = lua_gettop(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);  /* outer task */
+  lua_pushcfunction(L, task_call);
+  lua_pushlightuserdata(L, ts);
+  int status = lua_pcall(L, 1, 2, 0);
+  if (status == LUA_OK)
+    status = (int) lua_tointeger(L, -2);
+  size_t l = 0;
+  const char *s = NULL;
+  if (status != LUA_OK) {
+    s = lua_tolstring(L, -1, &l);
+    if (s == NULL) {
+      s = _("error object is not a string");
+      l = strlen(s);
+    }
+  }
+  finish(ts, status, s, l, (status == LUA_OK) ? (Results *) lua_touserdata(L, -1) : NULL);
+  lua_pushvalue(L, top + 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);
+  lua_settop(L, top);
+}
+
+
+static void* thread_proc (void *par) {
+  ThreadState *ts = (ThreadState *) par;
+  lua_State *L = ts->L;
+  ts->L = NULL;
+  execute(L, ts);
+  lua_close(L);
+  if (ts->tpl)  /* replace used ready state */
+    tpl_fill(ts->tpl);
+  return NULL;
+}
+
+
+static void push_head (Worker *w, ThreadState *ts) {
+  ts->prev = NULL;
+  ts->next = w->head;
+  if (w->head)
+    w->head->prev = ts;
+  else
+    w->tail = ts;
+  w->head = ts;
+}
+
+
+static void push_tail (Worker *w, ThreadState *ts) {
+  ts->next = NULL;
+  ts->prev = w->tail;
+  if (w->tail)
+    w->tail->next = ts;
+  else
+    w->head = ts;
+  w->tail = ts;
+}
+
+
+static ThreadState * pop_tail (Worker *w) {
+  ThreadState *ts = w->tail;
+  if (ts) {
+    w->tail = ts->prev;
+    if (w->tail)
+      w->tail->next = NULL;
+    else
+      w->head = NULL;
+    ts->prev = NULL;
+  }
+  return ts;
+}
+
+
+static ThreadState * pop_head (Worker *w) {
+  ThreadState *ts = w->head;
+  if (ts) {
+    w->head = ts->next;
+    if (w->head)
+      w->head->prev = NULL;
+    else
+      w->tail = NULL;
+    ts->next = NULL;
+  }
+  return ts;
+}
+
+
+/* take own task or steal task from other worker */
+static ThreadState * takework (Worker *w) {
+  PoolState *ps = w->ps;
+  ThreadState *ts = NULL;
+  int i;
+  if (ATOMIC_get(&ps->nqueued) == 0)
+    return NULL;
+  MUTEX_lock(&w->mutex);
+  ts = pop_tail(w);
+  MUTEX_unlock(&w->mutex);
+  for (i = 1; ts == NULL && i < ps->nworkers; i++) {
+    Worker *victim = &ps->workers[(w->idx + i) % ps->nworkers];
+    if (victim->head == NULL)
+      continue;
+    MUTEX_lock(&victim->mutex);
+    ts = pop_head(victim);
+    MUTEX_unlock(&victim->mutex);
+  }
+  if (ts) {
+    ATOMIC_dec(&ps->nqueued);
+    if (ATOMIC_get(&ps->nblocked) > 0) {
+      MUTEX_lock(&ps->mutex);
+      COND_broadcast(&ps->space);
+      MUTEX_unlock(&ps->mutex);
+    }
+  }
+  return ts;
+}
+
+
+static void complete (PoolState *ps) {
+  if (ATOMIC_dec(&ps->nref) == 0) {
+    MUTEX_lock(&ps->mutex);
+    COND_broadcast(&ps->done);
+    MUTEX_unlock(&ps->mutex);
+  }
+}
+
+
+/* histogram bucket of microseconds: 4 buckets per power of 2 */
+static int bucket (lua_Integer usec) {
+  int e = 0;
+  lua_Unsigned v = (usec > 0) ? (lua_Unsigned) usec : 0;
+  if (v < 4)
+    return (int) v;
+  while ((v >> e) >= 8)
+    e++;
+  int idx = 4 * (e + 1) + (int) ((v >> e) & 3);
+  return (idx < NBUCKETS) ? idx : NBUCKETS - 1;
+}
+
+
+/* upper bound of bucket in microseconds */
+static lua_Integer bucketbound (int idx) {
+  if (idx < 4)
+    return idx + 1;
+  int e = idx / 4 - 1;
+  return (lua_Integer) (4 + idx % 4 + 1) << e;
+}
+
+
+static void run (Worker *w, ThreadState *ts) {
+  MUTEX_lock(&w->mutex);
+  ts->next = w->task;
+  w->task = ts;
+  MUTEX_unlock(&w->mutex);
+  lua_Integer start = THREAD_uclock();
+  w->wait[bucket(start - ts->queued)]++;
+  w->bytesin += (lua_Integer) ts->varsize;
+  w->depth++;
+  if (w->L)
+    execute(w->L, ts);
+  else {
+    const char *msg = _("cannot create state: not enough memory");
+    finish(ts, LUA_ERRMEM, msg, strlen(msg), NULL);
+  }
+  w->depth--;
+  lua_Integer time = THREAD_uclock() - start;
+  w->runtime[bucket(time)]++;
+  if (w->depth == 0)  /* nested tasks are counted by outer task */
+    w->busy += time;
+  if (ts->res)
+    w->bytesout += (lua_Integer) ((ts->status == LUA_OK) ? ((Results *) ts->res)->bytes : ts->ressize);
+  w->completed++;
+  MUTEX_lock(&w->mutex);
+  w->task = ts->next;
+  ts->next = NULL;
+  MUTEX_unlock(&w->mutex);
+  complete(w->ps);
+  release(ts);
+}
+
+
+/* drop queued tasks of closing pool */
+static void drain (Worker *w) {
+  ThreadState *ts;
+  MUTEX_lock(&w->mutex);
+  while ((ts = pop_head(w)) != NULL) {
+    const char *msg = _("canceled");
+    ATOMIC_dec(&w->ps->nqueued);
+    cancel(ts);
+    finish(ts, LUA_ERRRUN, msg, strlen(msg), NULL);
+    complete(w->ps);
+    release(ts);
+  }
+  MUTEX_unlock(&w->mutex);
+}
+
+
+static void* worker_proc (void *par) {
+  Worker *w = (Worker *) par;
+  PoolState *ps = w->ps;
+  w->L = workerstate(w);
+  for (;;) {
+    ThreadState *ts = takework(w);
+    if (ts) {
+      run(w, ts);
+      continue;
+    }
+    /* sleep until task queued */
+    MUTEX_lock(&ps->mutex);
+    ATOMIC_inc(&ps->nidle);
+    while (!ps->closing && ATOMIC_get(&ps->nqueued) == 0)
+      COND_wait(&ps->cond, &ps->mutex);
+    ATOMIC_dec(&ps->nidle);
+    int closing = ps->closing;
+    MUTEX_unlock(&ps->mutex);
+    if (closing)
+      break;
+  }
+  drain(w);
+  if (w->L)
+    lua_close(w->L);
+  return NULL;
+}
+
+
+/*
+** Queue task to deque of worker w (NULL for external task), place in
+** deques may be reserved by admit; return false if pool is closing
+*/
+static int enqueue (PoolState *ps, Worker *w, ThreadState *ts, int reserved) {
+  /* subtasks go to tail of own deque, other tasks are distributed
+     to heads of deques to be executed in order of adding */
+  int local = (w != NULL);
+  if (!local)
+    w = &ps->workers[(unsigned long) ATOMIC_inc(&ps->next) % ps->nworkers];
+  MUTEX_lock(&w->mutex);
+  if (ps->closing) {
+    MUTEX_unlock(&w->mutex);
+    if (reserved)
+      ATOMIC_dec(&ps->nqueued);
+    return 0;
+  }
+  ts->nref++;
+  ts->running = 1;
+  ts->queued = THREAD_uclock();
+  ATOMIC_inc(&ps->nref);
+  if (local)
+    push_tail(w, ts);
+  else
+    push_head(w, ts);
+  if (!reserved)
+    ATOMIC_inc(&ps->nqueued);
+  MUTEX_unlock(&w->mutex);
+  /* wake up sleeping worker */
+  if (ATOMIC_get(&ps->nidle) > 0) {
+    MUTEX_lock(&ps->mutex);
+    COND_notify(&ps->cond);
+    MUTEX_unlock(&ps->mutex);
+  }
+  return 1;
+}
+
+
+static void submit (lua_State *L, PoolState *ps, ThreadState *ts, int reserved) {
+  if (!enqueue(ps, getworker(L, ps), ts, reserved))
+    luaL_error(L, _("pool is closed"));
+}
+
+
+/* new task of pool ps (NULL for own native thread) or NULL */
+static ThreadState * newtask (PoolState *ps) {
+  ThreadState *ts = (ThreadState *) malloc(sizeof(ThreadState));
+  if (ts == NULL)
+    return NULL;
+  ts->L = NULL;
+  ts->var = NULL;
+  ts->varsize = 0;
+  ts->res = NULL;
+  ts->ressize = 0;
+  ts->status = LUA_OK;
+  ts->id = 0;
+  ts->joinable = 0;
+  ts->running = 0;
+  ts->interrupted = 0;
+  ts->canceled = 0;
+  ts->nref = 1;
+  ts->waiters = NULL;
+  ts->ps = ps;
+  ts->tpl = NULL;
+  ts->proc = NULL;
+  ts->aq = NULL;
+  ts->anext = NULL;
+  ts->queued = 0;
+  ts->prev = ts->next = NULL;
+  MUTEX_init(&ts->mutex);
+  COND_init(&ts->cond);
+  return ts;
+}
+
+
+static ThreadState * create (lua_State *L, int idx, PoolState *ps) {
+  luaL_checktype(L, idx, LUA_TFUNCTION);
+  int count = lua_gettop(L);
+  ThreadState **box = (ThreadState **) lua_newuserdata(L, sizeof(ThreadState *));
+  *box = NULL;
+  luaL_setmetatable(L, LUA_THREADHANDLE);
+  ThreadState *ts = newtask(ps);
+  if (ts == NULL)
+    luaL_error(L, _("not enough memory"));
+  *box = ts;
+  /* serialize variables */
+  lua_serialize(L, idx, count);
+  const char *s = lua_tolstring(L, -1, &ts->varsize);
+  ts->var = (char *) malloc(sizeof(char) * ts->varsize);
+  if (ts->var == NULL)
+    luaL_error(L, _("not enough memory"));
+  memcpy(ts->var, s, ts->varsize);
+  lua_pop(L, 1);
   return ts;
 }
 
 
-static int tnew (lua_State *L) {
-  create(L, 1, NULL);
-  return 1;
+/*
+** Read attributes from options table at idx:
+** cpu (number or list), stack, priority, name
+*/
+static void getattr (lua_State *L, int idx, ThreadAttr *ta) {
+  memset(ta, 0, sizeof(ThreadAttr));
+  if (lua_getfield(L, idx, "cpu") == LUA_TNUMBER) {
+    ta->cpu[ta->ncpu++] = (int) lua_tointeger(L, -1);
+  } else if (lua_istable(L, -1)) {
+    lua_Integer i, n = luaL_len(L, -1);
+    luaL_argcheck(L, n <= MAXAFFINITY, idx, _("too many CPUs"));
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, -1, i);
+      ta->cpu[ta->ncpu++] = (int) luaL_checkinteger(L, -1);
+      lua_pop(L, 1);
+    }
+  } else if (!lua_isnil(L, -1))
+    luaL_argerror(L, idx, _("cpu must be number or list"));
+  lua_pop(L, 1);
+  int i, ncpu = THREAD_ncpu();
+  for (i = 0; i < ta->ncpu; i++)
+    luaL_argcheck(L, ta->cpu[i] >= 0 && ta->cpu[i] < ncpu, idx, _("CPU number out of range"));
+  lua_getfield(L, idx, "stack");
+  lua_Integer stack = luaL_optinteger(L, -1, 0);
+  luaL_argcheck(L, stack >= 0, idx, _("stack size must not be negative"));
+  ta->stack = (size_t) stack;
+  lua_getfield(L, idx, "priority");
+  ta->priority = (int) luaL_optinteger(L, -1, 0);
+  luaL_argcheck(L, ta->priority >= -2 && ta->priority <= 2, idx, _("priority out of range"));
+  lua_getfield(L, idx, "name");
+  const char *name = luaL_optstring(L, -1, "");
+  strncpy(ta->name, name, sizeof(ta->name) - 1);
+  lua_pop(L, 3);
+}
+
+
+#define totemplate(L,idx) (*(Template **) luaL_checkudata(L, idx, LUA_TEMPLATEHANDLE))
+
+
+/* template in field of options table at idx or NULL */
+static Template * gettemplate (lua_State *L, int idx) {
+  Template *tpl = NULL;
+  if (lua_getfield(L, idx, "template") != LUA_TNIL)
+    tpl = totemplate(L, -1);
+  lua_pop(L, 1);
+  return tpl;
+}
+
+
+/*
+** Create thread calling function at idx with arguments after it or
+** thread with attributes {f, ...; cpu =, stack =, priority =, name =,
+** template =}, state is taken from template tpl if not NULL
+*/
+static ThreadState * spawn (lua_State *L, int idx, Template *tpl) {
+  ThreadAttr attr, *ta = NULL;
+  if (lua_istable(L, idx)) {
+    int i, n = (int) luaL_len(L, idx);
+    ta = &attr;
+    getattr(L, idx, ta);
+    if (tpl == NULL)
+      tpl = gettemplate(L, idx);
+    lua_settop(L, idx);
+    luaL_checkstack(L, n, NULL);
+    for (i = 1; i <= n; i++)
+      lua_rawgeti(L, idx, i);
+    lua_remove(L, idx);
+  }
+  ThreadState *ts = create(L, idx, NULL);
+  lua_State *L1;
+  if (tpl) {
+    shared_retain(&tpl->obj);
+    ts->tpl = tpl;
+    L1 = tpl_take(tpl);
+  } else
+    L1 = luaL_newstate();
+  if (L1 == NULL)
+    luaL_error(L, _("cannot create state: not enough memory"));
+  /* create thread */
+  MUTEX_lock(&ts->mutex);
+  ts->L = L1;
+  ts->running = THREAD_create(&ts->thread, thread_proc, ts, ta);
+  ts->joinable = ts->running;
+  if (!ts->running) {
+    ts->L = NULL;
+    MUTEX_unlock(&ts->mutex);
+    lua_close(L1);
+    luaL_error(L, _("cannot create thread"));
+  }
+  MUTEX_unlock(&ts->mutex);
+  return ts;
+}
+
+
+static int tnew (lua_State *L) {
+  spawn(L, 1, NULL);
+  return 1;
+}
+
+
+static PoolHandle * newpool (lua_State *L, PoolState *ps, int owner) {
+  PoolHandle *ph = (PoolHandle *) lua_newuserdata(L, sizeof(PoolHandle));
+  ph->ps = ps;
+  ph->owner = owner;
+  ph->ref = NULL;
+  ph->refcap = 0;
+  ph->refsize = 0;
+  luaL_setmetatable(L, LUA_POOLHANDLE);
+  return ph;
+}
+
+
+/* release reference to timer t (timers locked) */
+static void timer_release (Timer *t) {
+  if (--t->nref == 0) {
+    free(t->var);
+    free(t);
+  }
+}
+
+
+static void heap_swap (PoolState *ps, int i, int j) {
+  Timer *t = ps->timers[i];
+  ps->timers[i] = ps->timers[j];
+  ps->timers[j] = t;
+  ps->timers[i]->pos = i;
+  ps->timers[j]->pos = j;
+}
+
+
+static void heap_up (PoolState *ps, int i) {
+  while (i > 0 && ps->timers[(i - 1) / 2]->due > ps->timers[i]->due) {
+    heap_swap(ps, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+
+static void heap_down (PoolState *ps, int i) {
+  for (;;) {
+    int min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < ps->ntimers && ps->timers[l]->due < ps->timers[min]->due)
+      min = l;
+    if (r < ps->ntimers && ps->timers[r]->due < ps->timers[min]->due)
+      min = r;
+    if (min == i)
+      return;
+    heap_swap(ps, i, min);
+    i = min;
+  }
+}
+
+
+/* add timer to heap (timers locked, capacity is checked by caller) */
+static void heap_push (PoolState *ps, Timer *t) {
+  t->pos = ps->ntimers++;
+  ps->timers[t->pos] = t;
+  heap_up(ps, t->pos);
+}
+
+
+/* remove timer from heap (timers locked) */
+static void heap_remove (PoolState *ps, Timer *t) {
+  int i = t->pos;
+  ps->ntimers--;
+  if (i != ps->ntimers) {
+    ps->timers[i] = ps->timers[ps->ntimers];
+    ps->timers[i]->pos = i;
+    heap_down(ps, i);
+    heap_up(ps, i);
+  }
+  t->pos = -1;
+}
+
+
+/* queue call of due timer to pool */
+static void timer_fire (PoolState *ps, const char *var, size_t varsize) {
+  ThreadState *ts = newtask(ps);
+  if (ts == NULL)
+    return;
+  ts->var = (char *) malloc(sizeof(char) * varsize);
+  if (ts->var) {
+    memcpy(ts->var, var, varsize);
+    ts->varsize = varsize;
+    enqueue(ps, NULL, ts, 0);
+  }
+  release(ts);  /* results are not joined */
+}
+
+
+static void* timer_proc (void *par) {
+  PoolState *ps = (PoolState *) par;
+  MUTEX_lock(&ps->tmutex);
+  while (!ps->stopping) {
+    if (ps->ntimers == 0) {
+      COND_wait(&ps->tcond, &ps->tmutex);
+      continue;
+    }
+    Timer *t = ps->timers[0];
+    lua_Integer now = THREAD_clock();
+    if (t->due > now) {
+      COND_waitfor(&ps->tcond, &ps->tmutex, (unsigned long) (t->due - now));
+      continue;
+    }
+    heap_remove(ps, t);
+    t->count++;
+    if (t->period > 0) {  /* schedule next call, missed calls are skipped */
+      t->due += t->period;
+      if (t->due <= now)
+        t->due = now + t->period;
+      heap_push(ps, t);
+      t->nref++;  /* heap keeps own reference */
+    }
+    MUTEX_unlock(&ps->tmutex);
+    timer_fire(ps, t->var, t->varsize);
+    MUTEX_lock(&ps->tmutex);
+    timer_release(t);
+  }
+  MUTEX_unlock(&ps->tmutex);
+  return NULL;
+}
+
+
+/*
+** Close pool of collected owner: stop timers, let queued and executing
+** tasks (and their subtasks) complete, then stop workers; tasks are
+** canceled only by explicit cancel
+*/
+static void closepool (PoolState *ps) {
+  int i;
+  MUTEX_lock(&ps->tmutex);
+  ps->stopping = 1;
+  COND_broadcast(&ps->tcond);
+  MUTEX_unlock(&ps->tmutex);
+  if (ps->hastimer) {
+    THREAD_join(ps->timer);
+    ps->hastimer = 0;
+  }
+  MUTEX_lock(&ps->mutex);
+  while (ATOMIC_get(&ps->nref) > 0)
+    COND_wait(&ps->done, &ps->mutex);
+  ps->closing = 1;
+  COND_broadcast(&ps->cond);
+  COND_broadcast(&ps->space);
+  MUTEX_unlock(&ps->mutex);
+  for (i = 0; i < ps->nworkers; i++)
+    THREAD_join(ps->workers[i].thread);
+}
+
+
+static void freepool (PoolState *ps) {
+  int i;
+  for (i = 0; i < ps->nworkers; i++)
+    MUTEX_destroy(&ps->workers[i].mutex);
+  if (ps->workers)
+    free(ps->workers);
+  MUTEX_destroy(&ps->mutex);
+  COND_destroy(&ps->cond);
+  COND_destroy(&ps->done);
+  COND_destroy(&ps->space);
+  for (i = 0; i < ps->ntimers; i++)
+    timer_release(ps->timers[i]);
+  free(ps->timers);
+  MUTEX_destroy(&ps->tmutex);
+  COND_destroy(&ps->tcond);
+  tpl_release(ps->tpl);
+  free(ps);
+}
+
+
+/*
+** Create pool of n workers or pool with attributes {n; cpu =, stack =,
+** priority =, name =, template =, queue =, policy =, keep =}, workers
+** are pinned to listed CPUs in turn and take states from template
+*/
+static int tpool (lua_State *L) {
+  ThreadAttr attr, *ta = NULL;
+  Template *tpl = NULL;
+  lua_Integer maxqueued = 0;
+  int policy = POLICY_BLOCK, keep = 1;
+  if (lua_istable(L, 1)) {
+    ta = &attr;
+    getattr(L, 1, ta);
+    tpl = gettemplate(L, 1);
+    lua_getfield(L, 1, "queue");
+    maxqueued = luaL_optinteger(L, -1, 0);
+    luaL_argcheck(L, maxqueued >= 0 && maxqueued <= INT_MAX, 1, _("queue size out of range"));
+    lua_getfield(L, 1, "policy");
+    policy = luaL_checkoption(L, -1, "block", policies);
+    lua_getfield(L, 1, "keep");
+    keep = (lua_isnil(L, -1)) ? (maxqueued == 0) : lua_toboolean(L, -1);
+    lua_pop(L, 3);
+    lua_rawgeti(L, 1, 1);
+    lua_replace(L, 1);
+  }
+  int n = (int) luaL_optinteger(L, 1, THREAD_ncpu());
+  luaL_argcheck(L, n > 0, 1, _("number of workers must be positive"));
+  PoolHandle *ph = newpool(L, NULL, 1);
+  PoolState *ps = (PoolState *) malloc(sizeof(PoolState));
+  if (ps == NULL)
+    return luaL_error(L, _("not enough memory"));
+  MUTEX_init(&ps->mutex);
+  COND_init(&ps->cond);
+  COND_init(&ps->done);
+  COND_init(&ps->space);
+  ps->nref = 0;
+  ps->nqueued = 0;
+  ps->nblocked = 0;
+  ps->maxqueued = (int) maxqueued;
+  ps->policy = policy;
+  ps->keep = keep;
+  MUTEX_init(&ps->tmutex);
+  COND_init(&ps->tcond);
+  ps->timers = NULL;
+  ps->ntimers = 0;
+  ps->timercap = 0;
+  ps->hastimer = 0;
+  ps->nidle = 0;
+  ps->next = 0;
+  ps->stopping = 0;
+  ps->closing = 0;
+  ps->nworkers = 0;
+  ps->tpl = tpl;
+  if (tpl)
+    shared_retain(&tpl->obj);
+  ps->workers = (Worker *) malloc(sizeof(Worker) * n);
+  if (ps->workers == NULL) {
+    freepool(ps);
+    return luaL_error(L, _("not enough memory"));
+  }
+  shared_register(&ps->obj);
+  ph->ps = ps;
+  /* start workers */
+  int i;
+  for (i = 0; i < n; i++) {
+    Worker *w = &ps->workers[i];
+    MUTEX_init(&w->mutex);
+    w->head = w->tail = NULL;
+    w->task = NULL;
+    w->depth = 0;
+    w->idx = i;
+    w->L = NULL;
+    w->ps = ps;
+    w->completed = w->busy = w->bytesin = w->bytesout = 0;
+    memset((void *) w->wait, 0, sizeof(w->wait));
+    memset((void *) w->runtime, 0, sizeof(w->runtime));
+  }
+  for (; ps->nworkers < n; ps->nworkers++) {
+    ThreadAttr wattr, *wa = NULL;
+    if (ta) {
+      wa = &wattr;
+      *wa = *ta;
+      if (ta->ncpu) {
+        wa->ncpu = 1;
+        wa->cpu[0] = ta->cpu[ps->nworkers % ta->ncpu];
+      }
+      if (ta->name[0]) {
+        /* name is cut to keep number of worker */
+        char num[16];
+        int l = snprintf(num, sizeof(num), "%d", ps->nworkers + 1);
+        int prefix = (int) sizeof(wa->name) - 1 - l;
+        if (snprintf(wa->name, sizeof(wa->name), "%.*s%s", prefix, ta->name, num) < 0)
+          wa->name[0] = '\0';
+      }
+    }
+    if (!THREAD_create(&ps->workers[ps->nworkers].thread, worker_proc, &ps->workers[ps->nworkers], wa)) {
+      for (i = ps->nworkers; i < n; i++)
+        MUTEX_destroy(&ps->workers[i].mutex);
+      return luaL_error(L, _("cannot create thread"));
+    }
+  }
+  return 1;
+}
+
+
+/* reserve place in bounded queue of pool, return false if queue is full */
+static int reserve (PoolState *ps) {
+  for (;;) {
+    long n = ATOMIC_get(&ps->nqueued);
+    if (n >= ps->maxqueued)
+      return 0;
+    if (ATOMIC_cas(&ps->nqueued, n, n + 1))
+      return 1;
+  }
+}
+
+
+/*
+** Wait for space in bounded queue of pool and reserve it (enqueue
+** with reserved place), return policy to apply if queue is full
+** (POLICY_BLOCK if place is reserved or queue is unbounded)
+*/
+static int admit (lua_State *L, PoolState *ps) {
+  if (ps->maxqueued == 0)
+    return POLICY_BLOCK;
+  while (!reserve(ps)) {
+    if (ps->policy != POLICY_BLOCK)
+      return ps->policy;
+    if (getworker(L, ps))  /* blocked workers can not take tasks */
+      return POLICY_CALLER;
+    MUTEX_lock(&ps->mutex);
+    if (ps->closing) {
+      MUTEX_unlock(&ps->mutex);
+      luaL_error(L, _("pool is closed"));
+    }
+    ATOMIC_inc(&ps->nblocked);
+    while (!ps->closing && ATOMIC_get(&ps->nqueued) >= ps->maxqueued) {
+      if (iscanceled(L)) {
+        ATOMIC_dec(&ps->nblocked);
+        MUTEX_unlock(&ps->mutex);
+        luaL_error(L, _("canceled"));
+      }
+      COND_waitfor(&ps->space, &ps->mutex, CHECKCANCEL);
+    }
+    ATOMIC_dec(&ps->nblocked);
+    MUTEX_unlock(&ps->mutex);
+  }
+  return POLICY_BLOCK;
+}
+
+
+/* add reference to task handle at top, drop handles of finished tasks if pool does not keep them */
+static void addref (lua_State *L, PoolHandle *ph) {
+  if (ph->refsize == ph->refcap && !ph->ps->keep) {
+    size_t i, j = 0;
+    for (i = 0; i < ph->refsize; i++) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, ph->ref[i]);
+      ThreadState *ts = tothread(L, -1);
+      lua_pop(L, 1);
+      if (ts->running)
+        ph->ref[j++] = ph->ref[i];
+      else
+        luaL_unref(L, LUA_REGISTRYINDEX, ph->ref[i]);
+    }
+    ph->refsize = j;
+  }
+  if (ph->refsize == ph->refcap) {
+    size_t cap = (ph->refcap) ? ph->refcap * 2 : 16;
+    int *ref = (int *) realloc(ph->ref, sizeof(int) * cap);
+    if (ref == NULL)
+      luaL_error(L, _("not enough memory"));
+    ph->ref = ref;
+    ph->refcap = cap;
+  }
+  lua_pushvalue(L, -1);
+  ph->ref[ph->refsize++] = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+
+static int padd (lua_State *L) {
+  PoolHandle *ph = topool(L, 1);
+  /* task is created before place is reserved, errors do not lose place */
+  ThreadState *ts = create(L, 2, ph->ps);
+  int policy = admit(L, ph->ps);
+  if (policy == POLICY_FAIL) {
+    lua_pushnil(L);
+    lua_pushstring(L, _("queue is full"));
+    return 2;
+  }
+  if (policy == POLICY_CALLER) {  /* execute in caller state */
+    addref(L, ph);
+    ts->running = 1;
+    execute(L, ts);
+  } else {
+    submit(L, ph->ps, ts, ph->ps->maxqueued > 0);
+    addref(L, ph);
+  }
+  return 1;
+}
+
+
+/*
+** Wait until task completed or timeout (msec < 0 is infinite),
+** return true if completed
+*/
+static int waitfor (lua_State *L, ThreadState *ts, lua_Integer msec) {
+  if (msec < 0) {
+    Worker *w = (ts->ps) ? getworker(L, ts->ps) : NULL;
+    if (w && w->depth < MAXHELP) {
+      /* worker waits task of own pool: execute other tasks while waiting */
+      while (ts->running) {
+        ThreadState *task = takework(w);
+        if (task)
+          run(w, task);
+        else {
+          MUTEX_lock(&ts->mutex);
+          if (ts->running)
+            COND_waitfor(&ts->cond, &ts->mutex, 1);
+          MUTEX_unlock(&ts->mutex);
+        }
+      }
+    }
+  }
+  lua_Integer deadline = THREAD_clock() + msec;
+  MUTEX_lock(&ts->mutex);
+  while (ts->running) {
+    if (msec < 0)
+      COND_wait(&ts->cond, &ts->mutex);
+    else {
+      lua_Integer left = deadline - THREAD_clock();
+      if (left <= 0)
+        break;
+      COND_waitfor(&ts->cond, &ts->mutex, (unsigned long) left);
+    }
+  }
+  int done = !ts->running;
+  MUTEX_unlock(&ts->mutex);
+  return done;
+}
+
+
+static int tjoin (lua_State *L) {
+  ThreadState *ts = tothread(L, 1);
+  waitfor(L, ts, -1);
+  /* own native thread is joined by __gc, it may still close its state */
+  if (ts->status) {
+    /* if fail then copy error message to main thread */
+    lua_pushboolean(L, 0);
+    if (ts->res)
+      lua_pushlstring(L, ts->res, ts->ressize);
+    else
+      lua_pushstring(L, _("not enough memory"));
+    return 2;
+  } else {
+    /* if success then push results to main thread */
+    if (ts->res)
+      return pushresults(L, (Results *) ts->res);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+}
+
+
+static int tcancel (lua_State *L) {
+  cancel(tothread(L, 1));
+  return 0;
+}
+
+
+static int tready (lua_State *L) {
+  ThreadState *ts = tothread(L, 1);
+  lua_pushboolean(L, !ts->running);
+  return 1;
+}
+
+
+static int twait (lua_State *L) {
+  ThreadState *ts = tothread(L, 1);
+  lua_pushboolean(L, waitfor(L, ts, luaL_optinteger(L, 2, -1)));
+  return 1;
+}
+
+
+/* check list of thread objects, return count */
+static int checklist (lua_State *L, int idx) {
+  luaL_checktype(L, idx, LUA_TTABLE);
+  int i, n = (int) luaL_len(L, idx);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, idx, i);
+    if (luaL_testudata(L, -1, LUA_THREADHANDLE) == NULL)
+      luaL_error(L, _("thread object expected at index %d"), i);
+    lua_pop(L, 1);
+  }
+  return n;
+}
+
+
+/* find completed task in list, return its index or 0 */
+static int findready (lua_State *L, int idx, int n) {
+  int i;
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, idx, i);
+    ThreadState *ts = tothread(L, -1);
+    lua_pop(L, 1);
+    if (!ts->running)
+      return i;
+  }
+  return 0;
+}
+
+
+static int twait_any (lua_State *L) {
+  int n = checklist(L, 1);
+  lua_Integer msec = luaL_optinteger(L, 2, -1);
+  int i = findready(L, 1, n);
+  if (i == 0 && n > 0 && msec != 0) {
+    /* register waiter in all tasks */
+    Waiter w;
+    WaitNode *nodes = (WaitNode *) lua_newuserdata(L, sizeof(WaitNode) * n);
+    MUTEX_init(&w.mutex);
+    COND_init(&w.cond);
+    w.signaled = 0;
+    for (i = 0; i < n; i++) {
+      lua_rawgeti(L, 1, i + 1);
+      ThreadState *ts = tothread(L, -1);
+      lua_pop(L, 1);
+      WaitNode *node = &nodes[i];
+      node->w = &w;
+      node->ts = ts;
+      node->prev = NULL;
+      MUTEX_lock(&ts->mutex);
+      node->next = ts->waiters;
+      if (ts->waiters)
+        ts->waiters->prev = node;
+      ts->waiters = node;
+      if (!ts->running)
+        w.signaled = 1;
+      MUTEX_unlock(&ts->mutex);
+    }
+    /* sleep until any task completed */
+    lua_Integer deadline = THREAD_clock() + msec;
+    MUTEX_lock(&w.mutex);
+    while (!w.signaled) {
+      if (msec < 0)
+        COND_wait(&w.cond, &w.mutex);
+      else {
+        lua_Integer left = deadline - THREAD_clock();
+        if (left <= 0)
+          break;
+        COND_waitfor(&w.cond, &w.mutex, (unsigned long) left);
+      }
+    }
+    MUTEX_unlock(&w.mutex);
+    /* unregister waiter */
+    for (i = 0; i < n; i++) {
+      WaitNode *node = &nodes[i];
+      ThreadState *ts = node->ts;
+      MUTEX_lock(&ts->mutex);
+      if (node->prev)
+        node->prev->next = node->next;
+      else
+        ts->waiters = node->next;
+      if (node->next)
+        node->next->prev = node->prev;
+      MUTEX_unlock(&ts->mutex);
+    }
+    MUTEX_destroy(&w.mutex);
+    COND_destroy(&w.cond);
+    lua_pop(L, 1);
+    i = findready(L, 1, n);
+  }
+  if (i == 0)
+    return 0;
+  lua_pushinteger(L, i);
+  lua_rawgeti(L, 1, i);
+  return 2;
+}
+
+
+static int twait_all (lua_State *L) {
+  int i, n = checklist(L, 1);
+  lua_Integer msec = luaL_optinteger(L, 2, -1);
+  lua_Integer deadline = THREAD_clock() + msec;
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    ThreadState *ts = tothread(L, -1);
+    lua_pop(L, 1);
+    lua_Integer left = (msec < 0) ? -1 : deadline - THREAD_clock();
+    if (!waitfor(L, ts, (left < 0 && msec >= 0) ? 0 : left)) {
+      lua_pushboolean(L, 0);
+      return 1;
+    }
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int trunning (lua_State *L) {
+  ThreadState *ts = tothread(L, 1);
+  lua_pushboolean(L, ts->running);
+  return 1;
+}
+
+
+static int tinterrupt (lua_State *L) {
+  interrupt(tothread(L, 1));
+  return 0;
+}
+
+
+static int tinterrupted (lua_State *L) {
+  ThreadState *ts;
+  if (lua_gettop(L) > 0)
+    ts = tothread(L, 1);
+  else {
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);
+    if (lua_isnil(L, -1))
+      return luaL_error(L, _("not implement to main thread"));
+    else {
+      ts = (ThreadState *) lua_topointer(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  MUTEX_lock(&ts->mutex);
+  int interrupted = ts->interrupted;
+  MUTEX_unlock(&ts->mutex);
+  lua_pushboolean(L, interrupted);
+  return 1;
+}
+
+
+static int tid (lua_State *L) {
+  if (lua_gettop(L) > 0)
+    lua_pushinteger(L, tothread(L, 1)->id);
+  else
+    lua_pushinteger(L, (lua_Integer) THREAD_id());
+  return 1;
+}
+
+
+static int ttime (lua_State *L) {
+#ifdef _WIN32
+	SYSTEMTIME time;
+	GetLocalTime(&time);
+	lua_pushinteger(L, (lua_Integer) ((time.wHour * 3600 + time.wMinute * 60 + time.wSecond) * 1000 + time.wMilliseconds));
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	lua_pushinteger(L, (lua_Integer) (tv.tv_sec * 1000) + (tv.tv_usec / 1000));
+#endif
+  return 1;
+}
+
+
+static int tsleep (lua_State *L) {
+  lua_Integer timeout = luaL_checkinteger(L, 1);
+  if (timeout <= 0)
+    return 0;
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+  #ifdef _WIN32
+    Sleep((DWORD) timeout);
+  #else
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = timeout * 1000000;
+    nanosleep(&ts, NULL);
+  #endif
+  } else {
+    ThreadState *ts = (ThreadState *) lua_topointer(L, -1);
+    lua_pop(L, 1);
+    MUTEX_lock(&ts->mutex);
+    COND_waitfor(&ts->cond, &ts->mutex, timeout);
+    MUTEX_unlock(&ts->mutex);
+  }
+  return 0;
+}
+
+
+static int tgc (lua_State *L) {
+  ThreadState **box = (ThreadState **) luaL_checkudata(L, 1, LUA_THREADHANDLE);
+  ThreadState *ts = *box;
+  if (ts == NULL)
+    return 0;
+  *box = NULL;
+  if (ts->joinable) {
+    if (ts->running)
+      cancel(ts);
+    THREAD_join(ts->thread);
+    ts->joinable = 0;
+  }
+  release(ts);
+  return 0;
+}
+
+
+static int plen (lua_State *L) {
+  PoolHandle *ph = topool(L, 1);
+  lua_pushinteger(L, ph->refsize);
+  return 1;
+}
+
+
+static int pindex (lua_State *L) {
+  PoolHandle *ph = topool(L, 1);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    size_t idx = (size_t) luaL_checkinteger(L, 2);
+    luaL_argcheck(L, idx > 0 && idx <= ph->refsize, 1, _("index out of range"));
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ph->ref[idx - 1]);
+  } else {
+    luaL_getmetatable(L, LUA_POOLHANDLE);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+  }
+  return 1;
+}
+
+
+static int pairs_next (lua_State *L) {
+  PoolHandle *ph = topool(L, lua_upvalueindex(1));
+  size_t i = (size_t) luaL_checkinteger(L, lua_upvalueindex(2));
+  if (i < ph->refsize) {
+    lua_pushinteger(L, i + 1);
+    lua_replace(L, lua_upvalueindex(2));
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ph->ref[i]);
+    return 1;
+  }
+  return 0;
+}
+
+
+static int ppairs (lua_State *L) {
+  topool(L, 1);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  lua_pushcclosure(L, pairs_next, 2);
+  return 1;
+}
+
+
+static int pwait (lua_State *L) {
+  PoolState *ps = topool(L, 1)->ps;
+  MUTEX_lock(&ps->mutex);
+  while (ATOMIC_get(&ps->nref) > 0)
+    COND_wait(&ps->done, &ps->mutex);
+  MUTEX_unlock(&ps->mutex);
+  return 0;
+}
+
+
+static int pinterrupt (lua_State *L) {
+  PoolHandle *ph = topool(L, 1);
+  size_t i;
+  for (i = 0; i < ph->refsize; i++) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ph->ref[i]);
+    interrupt(tothread(L, -1));
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+
+static int pcancel (lua_State *L) {
+  PoolHandle *ph = topool(L, 1);
+  size_t i;
+  for (i = 0; i < ph->refsize; i++) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ph->ref[i]);
+    cancel(tothread(L, -1));
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+
+/* push table of percentiles in milliseconds of merged histogram */
+static void pushpercentiles (lua_State *L, lua_Integer *hist) {
+  static const struct { const char *name; double q; } percentiles[] = {
+    {"p50", 0.50}, {"p90", 0.90}, {"p99", 0.99}, {NULL, 0}
+  };
+  lua_Integer total = 0;
+  int i, b;
+  for (b = 0; b < NBUCKETS; b++)
+    total += hist[b];
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, total);
+  lua_setfield(L, -2, "count");
+  for (i = 0; percentiles[i].name; i++) {
+    lua_Integer sum = 0, rank = (lua_Integer) ceil(percentiles[i].q * (double) total);
+    for (b = 0; b < NBUCKETS - 1 && (total == 0 || sum + hist[b] < rank); b++)
+      sum += hist[b];
+    lua_pushnumber(L, (total) ? (lua_Number) bucketbound(b) / 1000 : 0);
+    lua_setfield(L, -2, percentiles[i].name);
+  }
+}
+
+
+/*
+** Return statistics of pool: counts of tasks, percentiles of queue wait
+** and run time (milliseconds, upper bounds of 4 buckets per power of 2),
+** bytes of serialized tasks and results, busy time of each worker
+*/
+static int pstats (lua_State *L) {
+  PoolState *ps = topool(L, 1)->ps;
+  lua_Integer wait[NBUCKETS], runtime[NBUCKETS];
+  lua_Integer completed = 0, running = 0, bytesin = 0, bytesout = 0;
+  int i, b;
+  memset(wait, 0, sizeof(wait));
+  memset(runtime, 0, sizeof(runtime));
+  lua_createtable(L, 0, 9);
+  lua_createtable(L, ps->nworkers, 0);  /* busy */
+  for (i = 0; i < ps->nworkers; i++) {
+    Worker *w = &ps->workers[i];
+    ThreadState *ts;
+    MUTEX_lock(&w->mutex);
+    for (ts = w->task; ts; ts = ts->next)
+      running++;
+    MUTEX_unlock(&w->mutex);
+    completed += w->completed;
+    bytesin += w->bytesin;
+    bytesout += w->bytesout;
+    for (b = 0; b < NBUCKETS; b++) {
+      wait[b] += w->wait[b];
+      runtime[b] += w->runtime[b];
+    }
+    lua_pushnumber(L, (lua_Number) w->busy / 1000);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "busy");
+  lua_pushinteger(L, ps->nworkers);
+  lua_setfield(L, -2, "workers");
+  lua_pushinteger(L, (lua_Integer) ATOMIC_get(&ps->nqueued));
+  lua_setfield(L, -2, "queued");
+  lua_pushinteger(L, running);
+  lua_setfield(L, -2, "running");
+  lua_pushinteger(L, completed);
+  lua_setfield(L, -2, "completed");
+  lua_pushinteger(L, bytesin);
+  lua_setfield(L, -2, "bytesin");
+  lua_pushinteger(L, bytesout);
+  lua_setfield(L, -2, "bytesout");
+  pushpercentiles(L, wait);
+  lua_setfield(L, -2, "wait");
+  pushpercentiles(L, runtime);
+  lua_setfield(L, -2, "run");
+  return 1;
+}
+
+
+/*
+** Timer handle references timer and its pool
+*/
+typedef struct TimerHandle {
+  Timer *t;
+  PoolState *ps;
+} TimerHandle;
+
+
+/* schedule call f(...) from idx to pool after msec, repeat with period if not 0 */
+static int schedule (lua_State *L, lua_Integer msec, lua_Integer period, int idx) {
+  PoolState *ps = topool(L, 1)->ps;
+  luaL_checktype(L, idx, LUA_TFUNCTION);
+  int count = lua_gettop(L);
+  TimerHandle *th = (TimerHandle *) lua_newuserdata(L, sizeof(TimerHandle));
+  th->t = NULL;
+  th->ps = NULL;
+  luaL_setmetatable(L, LUA_TIMERHANDLE);
+  Timer *t = (Timer *) malloc(sizeof(Timer));
+  if (t == NULL)
+    return luaL_error(L, _("not enough memory"));
+  t->due = THREAD_clock() + msec;
+  t->period = period;
+  t->count = 0;
+  t->var = NULL;
+  t->pos = -1;
+  t->nref = 1;
+  th->t = t;
+  shared_retain(&ps->obj);
+  th->ps = ps;
+  /* serialize variables */
+  lua_serialize(L, idx, count);
+  const char *s = lua_tolstring(L, -1, &t->varsize);
+  t->var = (char *) malloc(sizeof(char) * t->varsize);
+  if (t->var == NULL)
+    return luaL_error(L, _("not enough memory"));
+  memcpy(t->var, s, t->varsize);
+  lua_pop(L, 1);
+  MUTEX_lock(&ps->tmutex);
+  if (ps->stopping) {
+    MUTEX_unlock(&ps->tmutex);
+    return luaL_error(L, _("pool is closed"));
+  }
+  if (ps->ntimers == ps->timercap) {
+    int cap = (ps->timercap) ? ps->timercap * 2 : 16;
+    Timer **timers = (Timer **) realloc(ps->timers, sizeof(Timer *) * cap);
+    if (timers == NULL) {
+      MUTEX_unlock(&ps->tmutex);
+      return luaL_error(L, _("not enough memory"));
+    }
+    ps->timers = timers;
+    ps->timercap = cap;
+  }
+  if (!ps->hastimer) {
+    if (!THREAD_create(&ps->timer, timer_proc, ps, NULL)) {
+      MUTEX_unlock(&ps->tmutex);
+      return luaL_error(L, _("cannot create thread"));
+    }
+    ps->hastimer = 1;
+  }
+  t->nref++;  /* reference of heap */
+  heap_push(ps, t);
+  if (t->pos == 0)  /* new earliest timer */
+    COND_notify(&ps->tcond);
+  MUTEX_unlock(&ps->tmutex);
+  return 1;
+}
+
+
+/* pool:after(msec, f, ...) - queue call f(...) after msec milliseconds */
+static int pafter (lua_State *L) {
+  lua_Integer msec = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, msec >= 0, 2, _("time must not be negative"));
+  return schedule(L, msec, 0, 3);
+}
+
+
+/* pool:every(msec, f, ...) - queue call f(...) every msec milliseconds */
+static int pevery (lua_State *L) {
+  lua_Integer msec = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, msec > 0, 2, _("period must be positive"));
+  return schedule(L, msec, msec, 3);
+}
+
+
+/* cancel scheduled calls, return true if timer was scheduled */
+static int tmcancel (lua_State *L) {
+  TimerHandle *th = (TimerHandle *) luaL_checkudata(L, 1, LUA_TIMERHANDLE);
+  int res = 0;
+  if (th->t) {
+    MUTEX_lock(&th->ps->tmutex);
+    if (th->t->pos >= 0) {
+      heap_remove(th->ps, th->t);
+      timer_release(th->t);
+      res = 1;
+    }
+    MUTEX_unlock(&th->ps->tmutex);
+  }
+  lua_pushboolean(L, res);
+  return 1;
+}
+
+
+/* number of queued calls */
+static int tmcount (lua_State *L) {
+  TimerHandle *th = (TimerHandle *) luaL_checkudata(L, 1, LUA_TIMERHANDLE);
+  lua_Integer count = 0;
+  if (th->t) {
+    MUTEX_lock(&th->ps->tmutex);
+    count = th->t->count;
+    MUTEX_unlock(&th->ps->tmutex);
+  }
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+
+/* dropped handle does not cancel timer */
+static int tmrgc (lua_State *L) {
+  TimerHandle *th = (TimerHandle *) luaL_checkudata(L, 1, LUA_TIMERHANDLE);
+  PoolState *ps = th->ps;
+  if (ps) {
+    if (th->t) {
+      MUTEX_lock(&ps->tmutex);
+      timer_release(th->t);
+      MUTEX_unlock(&ps->tmutex);
+      th->t = NULL;
+    }
+    th->ps = NULL;
+    if (shared_release(&ps->obj))
+      freepool(ps);
+  }
+  return 0;
+}
+
+
+/*
+** Chunk procs of map, foreach and reduce: called with function and
+** chunk (list of values with count in field n) in worker
+*/
+static lua_Integer chunklen (lua_State *L) {
+  lua_getfield(L, 2, "n");
+  lua_Integer n = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return n;
+}
+
+
+static int mapchunk (lua_State *L) {
+  lua_Integer i, n = chunklen(L);
+  lua_createtable(L, (int) n, 0);
+  for (i = 1; i <= n; i++) {
+    lua_pushvalue(L, 1);
+    lua_rawgeti(L, 2, i);
+    lua_call(L, 1, 1);
+    lua_rawseti(L, 3, i);
+  }
+  return 1;
+}
+
+
+static int foreachchunk (lua_State *L) {
+  lua_Integer i, n = chunklen(L);
+  for (i = 1; i <= n; i++) {
+    lua_pushvalue(L, 1);
+    lua_rawgeti(L, 2, i);
+    lua_call(L, 1, 0);
+  }
+  return 0;
+}
+
+
+static int reducechunk (lua_State *L) {
+  lua_Integer i, n = chunklen(L);
+  lua_rawgeti(L, 2, 1);
+  for (i = 2; i <= n; i++) {
+    lua_pushvalue(L, 1);
+    lua_insert(L, -2);
+    lua_rawgeti(L, 2, i);
+    lua_call(L, 2, 1);
+  }
+  return 1;
+}
+
+
+/* pool in field of options table at idx, pool of current worker or default pool */
+static PoolState * getpool (lua_State *L, int idx) {
+  if (!lua_isnoneornil(L, idx)) {
+    luaL_checktype(L, idx, LUA_TTABLE);
+    if (lua_getfield(L, idx, "pool") != LUA_TNIL) {
+      PoolState *ps = topool(L, -1)->ps;
+      lua_pop(L, 1);
+      return ps;
+    }
+    lua_pop(L, 1);
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_WORKER_USERDATA);
+  Worker *w = (Worker *) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (w)
+    return w->ps;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_POOL_USERDATA) == LUA_TNIL) {
+    lua_pop(L, 1);
+    lua_pushcfunction(L, tpool);
+    lua_call(L, 0, 1);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_POOL_USERDATA);
+  }
+  PoolState *ps = topool(L, -1)->ps;
+  lua_pop(L, 1);
+  return ps;
+}
+
+
+/*
+** Split list at tidx into chunks, queue proc(f, chunk) for each chunk
+** to pool and push list of chunk tasks; size of chunks is stored to
+** 'size' (last chunk may be smaller)
+*/
+static int chunks (lua_State *L, int fidx, int tidx, int oidx, lua_CFunction proc, lua_Integer *size) {
+  luaL_checktype(L, fidx, LUA_TFUNCTION);
+  luaL_checktype(L, tidx, LUA_TTABLE);
+  PoolState *ps = getpool(L, oidx);
+  lua_Integer i, j, n = (lua_Integer) lua_rawlen(L, tidx);
+  lua_Integer chunk = 0;
+  if (!lua_isnoneornil(L, oidx)) {
+    lua_getfield(L, oidx, "chunk");
+    chunk = luaL_optinteger(L, -1, 0);
+    luaL_argcheck(L, chunk >= 0, oidx, _("chunk size must be positive"));
+    lua_pop(L, 1);
+  }
+  if (chunk == 0)  /* default */
+    chunk = (n + ps->nworkers * CHUNKSPERWORKER - 1) / (ps->nworkers * CHUNKSPERWORKER);
+  if (chunk == 0)
+    chunk = 1;
+  int nchunks = (int) ((n + chunk - 1) / chunk);
+  *size = chunk;
+  lua_createtable(L, nchunks, 0);
+  int list = lua_gettop(L);
+  for (i = 0; i < nchunks; i++) {
+    lua_Integer first = i * chunk, m = (n - first < chunk) ? n - first : chunk;
+    lua_pushvalue(L, fidx);
+    lua_createtable(L, (int) m, 1);
+    for (j = 1; j <= m; j++) {
+      lua_rawgeti(L, tidx, first + j);
+      lua_rawseti(L, -2, j);
+    }
+    lua_pushinteger(L, m);
+    lua_setfield(L, -2, "n");
+    ThreadState *ts = create(L, list + 1, ps);
+    ts->proc = proc;
+    submit(L, ps, ts, 0);
+    lua_rawseti(L, list, i + 1);
+    lua_pop(L, 2);
+  }
+  return nchunks;
+}
+
+
+/*
+** Join chunk task i of list at index 'list', push its results (without
+** status); on error cancel other tasks and raise error
+*/
+static int joinchunk (lua_State *L, int list, int i, int nchunks) {
+  lua_rawgeti(L, list, i);
+  ThreadState *ts = tothread(L, -1);
+  lua_pop(L, 1);
+  waitfor(L, ts, -1);
+  if (ts->status) {
+    int k;
+    for (k = i + 1; k <= nchunks; k++) {
+      lua_rawgeti(L, list, k);
+      cancel(tothread(L, -1));
+      lua_pop(L, 1);
+    }
+    if (ts->res)
+      lua_pushlstring(L, ts->res, ts->ressize);
+    else
+      lua_pushstring(L, _("not enough memory"));
+    lua_error(L);
+  }
+  if (ts->res == NULL)
+    return 0;
+  int top = lua_gettop(L);
+  int nresults = pushresults(L, (Results *) ts->res) - 1;
+  while (lua_gettop(L) - top > nresults)  /* remove status and deserialized copies */
+    lua_remove(L, top + 1);
+  return nresults;
+}
+
+
+/* thread.map(f, list[, options]) - list of f(v) for values of list */
+static int tmap (lua_State *L) {
+  lua_settop(L, 3);
+  lua_Integer chunk, total = (lua_Integer) lua_rawlen(L, 2);
+  int i, nchunks = chunks(L, 1, 2, 3, mapchunk, &chunk);
+  lua_Integer j, n = 0;
+  lua_createtable(L, (int) total, 0);
+  lua_insert(L, -2);
+  for (i = 1; i <= nchunks; i++) {
+    joinchunk(L, 5, i, nchunks);
+    /* results of chunk may have holes of nil */
+    lua_Integer m = (total - n < chunk) ? total - n : chunk;
+    for (j = 1; j <= m; j++) {
+      lua_rawgeti(L, -1, j);
+      lua_rawseti(L, -4, n + j);
+    }
+    n += m;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/* thread.foreach(f, list[, options]) - call f(v) for values of list */
+static int tforeach (lua_State *L) {
+  lua_settop(L, 3);
+  lua_Integer chunk;
+  int i, nchunks = chunks(L, 1, 2, 3, foreachchunk, &chunk);
+  for (i = 1; i <= nchunks; i++)
+    joinchunk(L, 4, i, nchunks);
+  return 0;
+}
+
+
+/*
+** thread.reduce(f, init, list[, options]) - f(...f(f(init, v1), v2)...)
+** where f is associative, chunks are reduced in parallel
+*/
+static int treduce (lua_State *L) {
+  lua_settop(L, 4);
+  lua_Integer chunk;
+  int i, nchunks = chunks(L, 1, 3, 4, reducechunk, &chunk);
+  lua_pushvalue(L, 2);  /* accumulator */
+  lua_insert(L, -2);
+  for (i = 1; i <= nchunks; i++) {
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, -3);
+    if (joinchunk(L, 6, i, nchunks) == 0)
+      lua_pushnil(L);
+    lua_call(L, 2, 1);
+    lua_replace(L, -3);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/* completion queue of state, created on first use */
+static AsyncQueue * getqueue (lua_State *L) {
+  AsyncQueue *aq;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_ASYNC_USERDATA) == LUA_TNIL) {
+    lua_pop(L, 1);
+    AsyncQueue **box = (AsyncQueue **) lua_newuserdata(L, sizeof(AsyncQueue *));
+    *box = NULL;
+    luaL_setmetatable(L, LUA_ASYNCHANDLE);
+    lua_newtable(L);  /* waiting coroutines by task */
+    lua_setuservalue(L, -2);
+    aq = (AsyncQueue *) malloc(sizeof(AsyncQueue));
+    if (aq == NULL)
+      luaL_error(L, _("not enough memory"));
+    if (!EVENT_init(&aq->event)) {
+      free(aq);
+      luaL_error(L, _("cannot create event"));
+    }
+    MUTEX_init(&aq->mutex);
+    aq->head = aq->tail = NULL;
+    aq->closed = 0;
+    aq->nref = 1;
+    aq->pending = 0;
+    *box = aq;
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_ASYNC_USERDATA);
+  }
+  aq = *(AsyncQueue **) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return aq;
+}
+
+
+/*
+** thread.async(f, ...) - queue f(...) to pool and suspend calling
+** coroutine until thread.dispatch resumes it with results of join
+*/
+static int tasync (lua_State *L) {
+  if (!lua_isyieldable(L))
+    return luaL_error(L, _("attempt to call async outside a coroutine"));
+  AsyncQueue *aq = getqueue(L);
+  PoolState *ps = getpool(L, lua_gettop(L) + 1);
+  ThreadState *ts = create(L, 1, ps);
+  ts->aq = aq;
+  ts->nref++;  /* reference of queue */
+  MUTEX_lock(&aq->mutex);
+  aq->nref++;
+  MUTEX_unlock(&aq->mutex);
+  if (!enqueue(ps, getworker(L, ps), ts, 0)) {
+    /* drop references of queue */
+    ts->aq = NULL;
+    ts->nref--;
+    MUTEX_lock(&aq->mutex);
+    aq->nref--;
+    MUTEX_unlock(&aq->mutex);
+    return luaL_error(L, _("pool is closed"));
+  }
+  /* coroutine waits for task, completion is dispatched after yield */
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_ASYNC_USERDATA);
+  lua_getuservalue(L, -1);
+  lua_pushlightuserdata(L, ts);
+  lua_pushthread(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+  aq->pending++;
+  return lua_yield(L, 0);
+}
+
+
+/*
+** thread.dispatch([timeout]) - wait for completed async tasks (timeout in
+** milliseconds, default 0, negative is infinite) and resume coroutines,
+** return number of resumed and still pending coroutines
+*/
+static int tdispatch (lua_State *L) {
+  lua_Integer msec = luaL_optinteger(L, 1, 0);
+  AsyncQueue *aq = getqueue(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_ASYNC_USERDATA);
+  lua_getuservalue(L, -1);
+  int waiting = lua_gettop(L);
+  MUTEX_lock(&aq->mutex);
+  int empty = (aq->head == NULL);
+  MUTEX_unlock(&aq->mutex);
+  if (empty && aq->pending > 0 && msec != 0)
+    EVENT_wait(&aq->event, msec);
+  EVENT_clear(&aq->event);
+  int count = 0;
+  for (;;) {
+    MUTEX_lock(&aq->mutex);
+    ThreadState *ts = aq->head;
+    if (ts) {
+      aq->head = ts->anext;
+      if (aq->head == NULL)
+        aq->tail = NULL;
+      ts->anext = NULL;
+    }
+    MUTEX_unlock(&aq->mutex);
+    if (ts == NULL)
+      break;
+    lua_pushlightuserdata(L, ts);
+    lua_rawget(L, waiting);
+    lua_State *co = lua_tothread(L, -1);
+    if (co == NULL) {  /* coroutine was not registered */
+      lua_pop(L, 1);
+      release(ts);
+      continue;
+    }
+    lua_pushlightuserdata(L, ts);
+    lua_pushnil(L);
+    lua_rawset(L, waiting);
+    aq->pending--;
+    /* results of join */
+    int top = lua_gettop(L), nresults;
+    if (ts->status) {
+      lua_pushboolean(L, 0);
+      if (ts->res)
+        lua_pushlstring(L, ts->res, ts->ressize);
+      else
+        lua_pushstring(L, _("not enough memory"));
+      nresults = 2;
+    } else if (ts->res)
+      nresults = pushresults(L, (Results *) ts->res);
+    else {
+      lua_pushboolean(L, 1);
+      nresults = 1;
+    }
+    release(ts);
+    lua_xmove(L, co, nresults);
+    lua_settop(L, top - 1);
+    count++;
+    int status = lua_resume(co, L, nresults);
+    if (status == LUA_OK || status == LUA_YIELD)
+      lua_settop(co, 0);
+    else {
+      lua_xmove(co, L, 1);  /* error message */
+      MUTEX_lock(&aq->mutex);
+      if (aq->head)  /* resume rest on next call */
+        EVENT_signal(&aq->event);
+      MUTEX_unlock(&aq->mutex);
+      return lua_error(L);
+    }
+  }
+  lua_pushinteger(L, count);
+  lua_pushinteger(L, aq->pending);
+  return 2;
+}
+
+
+/* thread.eventfd() - descriptor readable while async tasks are completed or nil */
+static int teventfd (lua_State *L) {
+  AsyncQueue *aq = getqueue(L);
+  int fd = EVENT_fd(&aq->event);
+  if (fd < 0)
+    return 0;
+  lua_pushinteger(L, fd);
+  return 1;
+}
+
+
+static int aqgc (lua_State *L) {
+  AsyncQueue **box = (AsyncQueue **) luaL_checkudata(L, 1, LUA_ASYNCHANDLE);
+  AsyncQueue *aq = *box;
+  *box = NULL;
+  if (aq) {
+    MUTEX_lock(&aq->mutex);
+    ThreadState *ts = aq->head;
+    aq->head = aq->tail = NULL;
+    aq->closed = 1;
+    MUTEX_unlock(&aq->mutex);
+    while (ts) {
+      ThreadState *next = ts->anext;
+      release(ts);
+      ts = next;
+    }
+    aq_release(aq);
+  }
+  return 0;
+}
+
+
+/*
+** Pool is serialized by id, so tasks can add subtasks to own pool
+*/
+static int pserialize (lua_State *L) {
+  lua_pushinteger(L, shared_serialize(&topool(L, 1)->ps->obj));
+  return 1;
+}
+
+
+static int pdeserialize (lua_State *L) {
+  lua_Integer id = luaL_checkinteger(L, 1);
+  PoolHandle *ph = newpool(L, NULL, 0);
+  ph->ps = (PoolState *) shared_acquire(id);
+  if (ph->ps == NULL)
+    return luaL_error(L, _("pool is closed"));
+  return 1;
+}
+
+
+static int pgc (lua_State *L) {
+  PoolHandle *ph = topool(L, 1);
+  if (ph->ref) {
+    size_t i;
+    for (i = 0; i < ph->refsize; i++)
+      luaL_unref(L, LUA_REGISTRYINDEX, ph->ref[i]);
+    free(ph->ref);
+    ph->ref = NULL;
+    ph->refsize = 0;
+  }
+  if (ph->ps) {
+    PoolState *ps = ph->ps;
+    ph->ps = NULL;
+    if (ph->owner)
+      closepool(ps);
+    if (shared_release(&ps->obj))
+      freepool(ps);
+  }
+  return 0;
+}
+
+
+/*
+** Channel is bounded lock-free MPMC ring of serialized messages.
+** Each cell sequence tells whether cell is free for push at position
+** (seq == pos) or holds message for pop at position (seq == pos + 1).
+*/
+typedef struct Cell {
+  ATOMIC seq;
+  char *data;
+  size_t size;
+} Cell;
+
+
+typedef struct Channel {
+  SharedObject obj;
+  ATOMIC pushpos;
+  ATOMIC poppos;
+  unsigned long mask;
+  Cell *cells;
+  MUTEX mutex;
+  COND cond;  /* message pushed or popped */
+  ATOMIC nwait;  /* sleeping pushers and poppers */
+} Channel;
+
+
+#define tochannel(L,idx) (*(Channel **) luaL_checkudata(L, idx, LUA_CHANNELHANDLE))
+
+
+static int ch_trypush (Channel *ch, char *data, size_t size) {
+  unsigned long pos = (unsigned long) ATOMIC_get(&ch->pushpos);
+  Cell *cell;
+  for (;;) {
+    cell = &ch->cells[pos & ch->mask];
+    long dif = (long) ((unsigned long) ATOMIC_get(&cell->seq) - pos);
+    if (dif == 0) {
+      if (ATOMIC_cas(&ch->pushpos, (long) pos, (long) (pos + 1)))
+        break;
+    } else if (dif < 0)
+      return 0;  /* full */
+    pos = (unsigned long) ATOMIC_get(&ch->pushpos);
+  }
+  cell->data = data;
+  cell->size = size;
+  ATOMIC_set(&cell->seq, (long) (pos + 1));
+  return 1;
+}
+
+
+static int ch_trypop (Channel *ch, char **data, size_t *size) {
+  unsigned long pos = (unsigned long) ATOMIC_get(&ch->poppos);
+  Cell *cell;
+  for (;;) {
+    cell = &ch->cells[pos & ch->mask];
+    long dif = (long) ((unsigned long) ATOMIC_get(&cell->seq) - (pos + 1));
+    if (dif == 0) {
+      if (ATOMIC_cas(&ch->poppos, (long) pos, (long) (pos + 1)))
+        break;
+    } else if (dif < 0)
+      return 0;  /* empty */
+    pos = (unsigned long) ATOMIC_get(&ch->poppos);
+  }
+  *data = cell->data;
+  *size = cell->size;
+  ATOMIC_set(&cell->seq, (long) (pos + ch->mask + 1));
+  return 1;
+}
+
+
+/* wake up sleeping pushers and poppers */
+static void ch_notify (Channel *ch) {
+  if (ATOMIC_get(&ch->nwait) > 0) {
+    MUTEX_lock(&ch->mutex);
+    COND_broadcast(&ch->cond);
+    MUTEX_unlock(&ch->mutex);
+  }
+}
+
+
+/*
+** Repeat push (or pop) until success or timeout (msec < 0 is infinite),
+** sleeping while channel is full (or empty)
+*/
+static int ch_wait (lua_State *L, Channel *ch, int push, char **data, size_t *size, lua_Integer msec) {
+  lua_Integer deadline = THREAD_clock() + msec;
+  for (;;) {
+    if ((push) ? ch_trypush(ch, *data, *size) : ch_trypop(ch, data, size)) {
+      ch_notify(ch);
+      return 1;
+    }
+    lua_Integer left = (msec < 0) ? CHECKCANCEL : deadline - THREAD_clock();
+    if (left <= 0)
+      return 0;
+    if (iscanceled(L)) {
+      if (push)
+        free(*data);
+      luaL_error(L, _("canceled"));
+    }
+    MUTEX_lock(&ch->mutex);
+    ATOMIC_inc(&ch->nwait);
+    /* check again after registration, then pushed message is not missed */
+    int ready = (push) ? (unsigned long) (ATOMIC_get(&ch->pushpos) - ATOMIC_get(&ch->poppos)) <= ch->mask
+                       : ATOMIC_get(&ch->pushpos) != ATOMIC_get(&ch->poppos);
+    if (!ready)
+      COND_waitfor(&ch->cond, &ch->mutex, (unsigned long) ((left < CHECKCANCEL) ? left : CHECKCANCEL));
+    ATOMIC_dec(&ch->nwait);
+    MUTEX_unlock(&ch->mutex);
+  }
+}
+
+
+static Channel ** newchannel (lua_State *L) {
+  Channel **box = (Channel **) lua_newuserdata(L, sizeof(Channel *));
+  *box = NULL;
+  luaL_setmetatable(L, LUA_CHANNELHANDLE);
+  return box;
+}
+
+
+static int tchannel (lua_State *L) {
+  lua_Integer capacity = luaL_optinteger(L, 1, 1024);
+  luaL_argcheck(L, capacity > 0 && capacity <= (LUA_MAXINTEGER >> 2), 1, _("capacity out of range"));
+  unsigned long i, size = 2;
+  while (size < (unsigned long) capacity)
+    size <<= 1;  /* round up to power of 2, at least 2 */
+  Channel **box = newchannel(L);
+  Channel *ch = (Channel *) malloc(sizeof(Channel));
+  if (ch == NULL)
+    return luaL_error(L, _("not enough memory"));
+  ch->cells = (Cell *) malloc(sizeof(Cell) * size);
+  if (ch->cells == NULL) {
+    free(ch);
+    return luaL_error(L, _("not enough memory"));
+  }
+  for (i = 0; i < size; i++)
+    ch->cells[i].seq = (long) i;
+  ch->mask = size - 1;
+  ch->pushpos = 0;
+  ch->poppos = 0;
+  ch->nwait = 0;
+  MUTEX_init(&ch->mutex);
+  COND_init(&ch->cond);
+  shared_register(&ch->obj);
+  *box = ch;
+  return 1;
+}
+
+
+/* serialize arguments from idx as one message */
+static char * ch_message (lua_State *L, int idx, size_t *size) {
+  lua_serialize(L, idx, lua_gettop(L));
+  const char *s = lua_tolstring(L, -1, size);
+  char *data = (char *) malloc(sizeof(char) * (*size));
+  if (data == NULL)
+    luaL_error(L, _("not enough memory"));
+  memcpy(data, s, *size);
+  lua_pop(L, 1);
+  return data;
+}
+
+
+static int ch_push (lua_State *L, lua_Integer msec) {
+  Channel *ch = tochannel(L, 1);
+  luaL_checkany(L, 2);
+  size_t size;
+  char *data = ch_message(L, 2, &size);
+  int res = ch_wait(L, ch, 1, &data, &size, msec);
+  if (!res)
+    free(data);
+  lua_pushboolean(L, res);
+  return 1;
+}
+
+
+static int chpush (lua_State *L) {
+  return ch_push(L, -1);
+}
+
+
+static int chtrypush (lua_State *L) {
+  return ch_push(L, 0);
+}
+
+
+static int ch_pop (lua_State *L, lua_Integer msec) {
+  Channel *ch = tochannel(L, 1);
+  char *data;
+  size_t size;
+  luaL_checkstack(L, 3, NULL);
+  if (!ch_wait(L, ch, 0, &data, &size, msec))
+    return 0;
+  pushfree(L, data, size);  /* message is freed even if push fails */
+  int top = lua_gettop(L);
+  int nresults = lua_deserialize(L, -1);
+  lua_remove(L, top);
+  return nresults;
+}
+
+
+static int chpop (lua_State *L) {
+  return ch_pop(L, luaL_optinteger(L, 2, -1));
+}
+
+
+static int chtrypop (lua_State *L) {
+  return ch_pop(L, 0);
+}
+
+
+static int chlen (lua_State *L) {
+  Channel *ch = tochannel(L, 1);
+  long n = (long) ((unsigned long) ATOMIC_get(&ch->pushpos) - (unsigned long) ATOMIC_get(&ch->poppos));
+  lua_pushinteger(L, (n > 0) ? n : 0);
+  return 1;
+}
+
+
+/*
+** Channel is serialized by id, so it can be passed to other threads
+*/
+static int chserialize (lua_State *L) {
+  lua_pushinteger(L, shared_serialize(&tochannel(L, 1)->obj));
+  return 1;
+}
+
+
+static int chdeserialize (lua_State *L) {
+  lua_Integer id = luaL_checkinteger(L, 1);
+  Channel **box = newchannel(L);
+  *box = (Channel *) shared_acquire(id);
+  if (*box == NULL)
+    return luaL_error(L, _("channel is closed"));
+  return 1;
+}
+
+
+static int chgc (lua_State *L) {
+  Channel **box = (Channel **) luaL_checkudata(L, 1, LUA_CHANNELHANDLE);
+  Channel *ch = *box;
+  *box = NULL;
+  if (ch && shared_release(&ch->obj)) {
+    char *data;
+    size_t size;
+    while (ch_trypop(ch, &data, &size))
+      free(data);
+    free(ch->cells);
+    MUTEX_destroy(&ch->mutex);
+    COND_destroy(&ch->cond);
+    free(ch);
+  }
+  return 0;
+}
+
+
+/*
+** Shared table is hash map of serialized keys and values outside of any
+** state. Keys are spread over shards locked independently, integer values
+** are kept as is to make counters cheap.
+*/
+typedef struct SharedEntry {
+  struct SharedEntry *next;
+  unsigned long hash;
+  char *key;
+  size_t keysize;
+  int isint;  /* value is integer i, else serialized data */
+  lua_Integer i;
+  char *data;
+  size_t size;
+} SharedEntry;
+
+
+typedef struct Shard {
+  MUTEX mutex;
+  SharedEntry **buckets;
+  unsigned long nbuckets;
+  unsigned long count;
+} Shard;
+
+
+typedef struct SharedTable {
+  SharedObject obj;
+  Shard shards[NSHARDS];
+} SharedTable;
+
+
+#define toshared(L,idx) (*(SharedTable **) luaL_checkudata(L, idx, LUA_SHAREDHANDLE))
+
+
+/* FNV-1a */
+static unsigned long sh_hash (const char *s, size_t l) {
+  unsigned long h = 2166136261UL;
+  size_t i;
+  for (i = 0; i < l; i++)
+    h = (h ^ (unsigned char) s[i]) * 16777619UL;
+  return h;
+}
+
+
+/* push serialized key at idx, return shard locked for key */
+/* serialize key at idx (kept on stack), return its shard (not locked) */
+static Shard * sh_key (lua_State *L, SharedTable *st, int idx, const char **key, size_t *keysize, unsigned long *hash) {
+  luaL_argcheck(L, !lua_isnoneornil(L, idx), idx, _("key is nil"));
+  if (lua_type(L, idx) == LUA_TNUMBER && !lua_isinteger(L, idx)) {
+    /* float key with integer value is integer key as in tables */
+    lua_Number n = lua_tonumber(L, idx);
+    luaL_argcheck(L, n == n, idx, _("key is NaN"));
+    int isint;
+    lua_Integer i = lua_tointegerx(L, idx, &isint);
+    if (isint) {
+      lua_pushinteger(L, i);
+      lua_serialize(L, -1, -1);
+      lua_remove(L, -2);
+    } else
+      lua_serialize(L, idx, idx);
+  } else
+    lua_serialize(L, idx, idx);
+  *key = lua_tolstring(L, -1, keysize);
+  *hash = sh_hash(*key, *keysize);
+  return &st->shards[*hash % NSHARDS];
 }
 
 
-static int tpool (lua_State *L) {
-  PoolState *ps = (PoolState *) lua_newuserdata(L, sizeof(PoolState));
-  MUTEX_init(&ps->mutex);
-  COND_init(&ps->cond);
-  ps->nref = 0;
-  ps->ref = NULL;
-  ps->refsize = 0;
-  luaL_setmetatable(L, LUA_POOLHANDLE);
-  return 1;
+static SharedEntry ** sh_find (Shard *sh, const char *key, size_t keysize, unsigned long hash) {
+  SharedEntry **p;
+  if (sh->nbuckets == 0)
+    return NULL;
+  p = &sh->buckets[(hash / NSHARDS) & (sh->nbuckets - 1)];
+  for (; *p; p = &(*p)->next) {
+    if ((*p)->hash == hash && (*p)->keysize == keysize && memcmp((*p)->key, key, keysize) == 0)
+      break;
+  }
+  return p;
 }
 
 
-static int padd (lua_State *L) {
-  PoolState *ps = (PoolState *) luaL_checkudata(L, 1, LUA_POOLHANDLE);
-  int *ref = (int *) realloc(ps->ref, sizeof(ThreadState) * (ps->refsize + 1));
-  if (ref == NULL)
-      return luaL_error(L, _("not enough memory"));
-  ps->ref = ref;
-  MUTEX_lock(&ps->mutex);
-  ps->nref++;
-  MUTEX_unlock(&ps->mutex);
-  create(L, 2, ps);
-  lua_pushvalue(L, -1);
-  ps->ref[ps->refsize] = luaL_ref(L, LUA_REGISTRYINDEX);
-  ps->refsize++;
-  return 1;
+static void sh_free (SharedEntry *e) {
+  free(e->key);
+  free(e->data);
+  free(e);
 }
 
 
-static int tjoin (lua_State *L) {
-  ThreadState *ts = (ThreadState *) luaL_checkudata(L, 1, LUA_THREADHANDLE);
-  MUTEX_lock(&ts->mutex);
-  if (ts->running) {
-    MUTEX_unlock(&ts->mutex);
-  #ifdef _WIN32
-    WaitForSingleObject(ts->thread, INFINITE);
-  #else
-    pthread_join(ts->thread, NULL);
-  #endif
-    MUTEX_lock(&ts->mutex);
-    ts->running = 0;
-  }
-  MUTEX_unlock(&ts->mutex);
-  size_t l;
-  const char *s;
-  if (ts->status) {
-    /* if fail then copy error message to main thread */
-    lua_pushboolean(L, 0);
-    s = lua_tolstring(ts->L, -1, &l);
-    lua_pushlstring(L, s, l);
-    return 2;
-  } else {
-    int nresults = 1;
-    /* if success then copy result to main thread */
-    lua_pushboolean(L, 1);
-    if (lua_isstring(ts->L, -1)) {
-      s = lua_tolstring(ts->L, -1, &l);
-      lua_pushlstring(L, s, l);
-      int top = lua_gettop(L);
-      nresults += lua_deserialize(L, -1);
-      lua_remove(L, top);
+/* double number of buckets when shard is loaded */
+static void sh_grow (Shard *sh) {
+  unsigned long i, n = (sh->nbuckets) ? sh->nbuckets * 2 : 8;
+  SharedEntry **buckets = (SharedEntry **) calloc(n, sizeof(SharedEntry *));
+  if (buckets == NULL)
+    return;  /* keep old buckets, only lookup is slower */
+  for (i = 0; i < sh->nbuckets; i++) {
+    SharedEntry *e = sh->buckets[i];
+    while (e) {
+      SharedEntry *next = e->next;
+      SharedEntry **b = &buckets[(e->hash / NSHARDS) & (n - 1)];
+      e->next = *b;
+      *b = e;
+      e = next;
     }
-    return nresults;
   }
+  free(sh->buckets);
+  sh->buckets = buckets;
+  sh->nbuckets = n;
 }
 
 
-static int tcancel (lua_State *L) {
-  ThreadState *ts = (ThreadState *) luaL_checkudata(L, 1, LUA_THREADHANDLE);
-  lua_cancel(ts->L);
-  MUTEX_lock(&ts->mutex);
-  COND_broadcast(&ts->cond);
-  MUTEX_unlock(&ts->mutex);
-  return 0;
+/* value at idx to be stored, integers is not serialized */
+typedef struct SharedValue {
+  int isnil;
+  int isint;
+  lua_Integer i;
+  char *data;  /* serialized value on stack or own copy (sh_own) */
+  size_t size;
+} SharedValue;
+
+
+/* serialize value at idx (kept on stack), errors leak nothing */
+static void sh_value (lua_State *L, int idx, SharedValue *v) {
+  v->isnil = lua_isnoneornil(L, idx);
+  v->isint = lua_isinteger(L, idx);
+  v->i = (v->isint) ? lua_tointeger(L, idx) : 0;
+  v->data = NULL;
+  v->size = 0;
+  if (!v->isnil && !v->isint) {
+    lua_serialize(L, idx, idx);
+    v->data = (char *) lua_tolstring(L, -1, &v->size);
+  }
 }
 
-static int trunning (lua_State *L) {
-  ThreadState *ts = (ThreadState *) luaL_checkudata(L, 1, LUA_THREADHANDLE);
-  lua_pushboolean(L, ts->running);
+
+/* copy serialized value to be owned by table, return false if not enough memory */
+static int sh_own (SharedValue *v) {
+  if (v->data) {
+    char *data = (char *) malloc(sizeof(char) * v->size);
+    if (data == NULL)
+      return 0;
+    memcpy(data, v->data, v->size);
+    v->data = data;
+  }
   return 1;
 }
 
 
-static int tinterrupt (lua_State *L) {
-  ThreadState *ts = (ThreadState *) luaL_checkudata(L, 1, LUA_THREADHANDLE);
-  MUTEX_lock(&ts->mutex);
-  ts->interrupted = 1;
-  COND_broadcast(&ts->cond);
-  MUTEX_unlock(&ts->mutex);
-  return 0;
+static int sh_equal (SharedEntry *e, SharedValue *v) {
+  if (e == NULL || v->isnil)
+    return e == NULL && v->isnil;
+  if (e->isint || v->isint)
+    return e->isint && v->isint && e->i == v->i;
+  return e->size == v->size && memcmp(e->data, v->data, v->size) == 0;
 }
 
 
-static int tinterrupted (lua_State *L) {
-  ThreadState *ts;
-  if (lua_gettop(L) > 0)
-    ts = (ThreadState *) luaL_checkudata(L, 1, LUA_THREADHANDLE);
-  else {
-    lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);
-    if (lua_isnil(L, -1))
-      return luaL_error(L, _("not implement to main thread"));
-    else {
-      ts = (ThreadState *) lua_topointer(L, -1);
-      lua_pop(L, 1);
+/*
+** Store value v to key in locked shard (nil removes key), v->data is
+** owned by table on success; return false if not enough memory
+*/
+static int sh_store (Shard *sh, SharedEntry **p, const char *key, size_t keysize, unsigned long hash, SharedValue *v) {
+  SharedEntry *e = (p) ? *p : NULL;
+  if (v->isnil) {
+    if (e) {
+      *p = e->next;
+      sh->count--;
+      sh_free(e);
     }
+    return 1;
   }
-  MUTEX_lock(&ts->mutex);
-  int interrupted = ts->interrupted;
-  MUTEX_unlock(&ts->mutex);
-  lua_pushboolean(L, interrupted);
+  if (e == NULL) {
+    e = (SharedEntry *) malloc(sizeof(SharedEntry));
+    if (e == NULL)
+      return 0;
+    e->key = (char *) malloc(sizeof(char) * keysize);
+    if (e->key == NULL) {
+      free(e);
+      return 0;
+    }
+    memcpy(e->key, key, keysize);
+    e->keysize = keysize;
+    e->hash = hash;
+    e->data = NULL;
+    if (sh->count >= sh->nbuckets)
+      sh_grow(sh);
+    if (sh->nbuckets == 0) {
+      sh_free(e);
+      return 0;
+    }
+    p = &sh->buckets[(hash / NSHARDS) & (sh->nbuckets - 1)];
+    e->next = *p;
+    *p = e;
+    sh->count++;
+  }
+  free(e->data);
+  e->isint = v->isint;
+  e->i = v->i;
+  e->data = v->data;
+  e->size = v->size;
   return 1;
 }
 
 
-static int tid (lua_State *L) {
-  if (lua_gettop(L) > 0) {
-    ThreadState *ts = (ThreadState *) luaL_checkudata(L, 1, LUA_THREADHANDLE);
-  #ifdef _WIN32
-    lua_pushinteger(L, (lua_Integer) ts->threadId);
-  #else
-    lua_pushinteger(L, (lua_Integer) ts->thread);
-  #endif
-  } else
-    lua_pushinteger(L, (lua_Integer) THREAD_id());
-  return 1;
+static SharedTable ** newshared (lua_State *L) {
+  SharedTable **box = (SharedTable **) lua_newuserdata(L, sizeof(SharedTable *));
+  *box = NULL;
+  luaL_setmetatable(L, LUA_SHAREDHANDLE);
+  return box;
 }
 
 
-static int ttime (lua_State *L) {
-#ifdef _WIN32
-	SYSTEMTIME time;
-	GetLocalTime(&time);
-	lua_pushinteger(L, (lua_Integer) ((time.wHour * 3600 + time.wMinute * 60 + time.wSecond) * 1000 + time.wMilliseconds));
-#else
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	lua_pushinteger(L, (lua_Integer) (tv.tv_sec * 1000) + (tv.tv_usec / 1000));
-#endif
-  return 1;
+static void freeshared (SharedTable *st) {
+  int i;
+  unsigned long j;
+  for (i = 0; i < NSHARDS; i++) {
+    Shard *sh = &st->shards[i];
+    for (j = 0; j < sh->nbuckets; j++) {
+      SharedEntry *e = sh->buckets[j];
+      while (e) {
+        SharedEntry *next = e->next;
+        sh_free(e);
+        e = next;
+      }
+    }
+    free(sh->buckets);
+    MUTEX_destroy(&sh->mutex);
+  }
+  free(st);
 }
 
 
-static int tsleep (lua_State *L) {
-  lua_Integer timeout = luaL_checkinteger(L, 1);
-  if (timeout <= 0)
-    return 0;
-  lua_getfield(L, LUA_REGISTRYINDEX, LUA_THREAD_USERDATA);
-  if (lua_isnil(L, -1)) {
-    lua_pop(L, 1);
-  #ifdef _WIN32
-    Sleep((DWORD) timeout);
-  #else
-    struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = timeout * 1000000;
-    nanosleep(&ts, NULL);
-  #endif
+static int tshared (lua_State *L) {
+  const char *name = luaL_optstring(L, 1, NULL);
+  SharedTable **box = newshared(L);
+  if (name) {  /* existing table with same name? */
+    *box = (SharedTable *) shared_registername(NULL, name);
+    if (*box)
+      return 1;
+  }
+  SharedTable *st = (SharedTable *) malloc(sizeof(SharedTable));
+  if (st == NULL)
+    return luaL_error(L, _("not enough memory"));
+  int i;
+  for (i = 0; i < NSHARDS; i++) {
+    MUTEX_init(&st->shards[i].mutex);
+    st->shards[i].buckets = NULL;
+    st->shards[i].nbuckets = 0;
+    st->shards[i].count = 0;
+  }
+  if (name) {
+    *box = (SharedTable *) shared_registername(&st->obj, name);
+    if (*box != st)  /* created concurrently by other thread */
+      freeshared(st);
   } else {
-    ThreadState *ts = (ThreadState *) lua_topointer(L, -1);
-    lua_pop(L, 1);
-    MUTEX_lock(&ts->mutex);
-    COND_waitfor(&ts->cond, &ts->mutex, timeout);
-    MUTEX_unlock(&ts->mutex);
+    shared_register(&st->obj);
+    *box = st;
   }
-  return 0;
+  return 1;
 }
 
 
-static int tgc (lua_State *L) {
-  ThreadState *ts = (ThreadState *) luaL_checkudata(L, 1, LUA_THREADHANDLE);
-  MUTEX_lock(&ts->mutex);
-  if (ts->running) {
-    lua_cancel(ts->L);
-    COND_broadcast(&ts->cond);
-    MUTEX_unlock(&ts->mutex);
-  #ifdef _WIN32
-    WaitForSingleObject(ts->thread, INFINITE);
-  #else
-    pthread_join(ts->thread, NULL);
-  #endif
-  } else
-    MUTEX_unlock(&ts->mutex);
-#ifdef _WIN32
-  if (ts->thread)
-    CloseHandle(ts->thread);
-#endif
-  MUTEX_destroy(&ts->mutex);
-  COND_destroy(&ts->cond);
-  lua_close(ts->L);
-  if (ts->var)
-    free(ts->var);
+static int shget (lua_State *L) {
+  SharedTable *st = toshared(L, 1);
+  const char *key;
+  size_t keysize;
+  unsigned long hash;
+  Shard *sh = sh_key(L, st, 2, &key, &keysize, &hash);
+  luaL_checkstack(L, 3, NULL);
+  MUTEX_lock(&sh->mutex);
+  SharedEntry **p = sh_find(sh, key, keysize, hash);
+  SharedEntry *e = (p) ? *p : NULL;
+  if (e == NULL) {
+    MUTEX_unlock(&sh->mutex);
+    lua_pushnil(L);
+    return 1;
+  }
+  if (e->isint) {
+    lua_Integer i = e->i;
+    MUTEX_unlock(&sh->mutex);
+    lua_pushinteger(L, i);
+    return 1;
+  }
+  /* copy value, nothing raises error while shard is locked */
+  size_t size = e->size;
+  char *data = (char *) malloc(sizeof(char) * size);
+  if (data)
+    memcpy(data, e->data, size);
+  MUTEX_unlock(&sh->mutex);
+  if (data == NULL)
+    return luaL_error(L, _("not enough memory"));
+  pushfree(L, data, size);
+  int top = lua_gettop(L);
+  lua_deserialize(L, -1);
+  lua_settop(L, top + 1);
+  lua_remove(L, top);
+  return 1;
+}
+
+
+static int shset (lua_State *L) {
+  SharedTable *st = toshared(L, 1);
+  SharedValue v;
+  const char *key;
+  size_t keysize;
+  unsigned long hash;
+  Shard *sh = sh_key(L, st, 2, &key, &keysize, &hash);
+  sh_value(L, 3, &v);
+  if (!sh_own(&v))
+    return luaL_error(L, _("not enough memory"));
+  MUTEX_lock(&sh->mutex);
+  int res = sh_store(sh, sh_find(sh, key, keysize, hash), key, keysize, hash, &v);
+  MUTEX_unlock(&sh->mutex);
+  if (!res) {
+    free(v.data);
+    return luaL_error(L, _("not enough memory"));
+  }
   return 0;
 }
 
 
-static int plen (lua_State *L) {
-  PoolState *ps = (PoolState *) luaL_checkudata(L, 1, LUA_POOLHANDLE);
-  lua_pushinteger(L, ps->refsize);
+/* set key to new value if current value is equal to old, return true if set */
+static int shcas (lua_State *L) {
+  SharedTable *st = toshared(L, 1);
+  SharedValue old, v;
+  const char *key;
+  size_t keysize;
+  unsigned long hash;
+  luaL_checkany(L, 3);
+  Shard *sh = sh_key(L, st, 2, &key, &keysize, &hash);
+  sh_value(L, 3, &old);  /* compared on stack */
+  sh_value(L, 4, &v);
+  if (!sh_own(&v))
+    return luaL_error(L, _("not enough memory"));
+  MUTEX_lock(&sh->mutex);
+  SharedEntry **p = sh_find(sh, key, keysize, hash);
+  int res = sh_equal((p) ? *p : NULL, &old);
+  int stored = res && sh_store(sh, p, key, keysize, hash, &v);
+  MUTEX_unlock(&sh->mutex);
+  if (!stored)
+    free(v.data);
+  if (res && !stored)
+    return luaL_error(L, _("not enough memory"));
+  lua_pushboolean(L, res);
   return 1;
 }
 
 
-static int pindex (lua_State *L) {
-  PoolState *ps = (PoolState *) luaL_checkudata(L, 1, LUA_POOLHANDLE);
-  if (lua_type(L, 2) == LUA_TNUMBER) {
-    size_t idx = (size_t) luaL_checkinteger(L, 2);
-    luaL_argcheck(L, idx > 0 && idx <= ps->refsize, 1, _("index out of range"));
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ps->ref[idx - 1]);
-  } else {
-    luaL_getmetatable(L, LUA_POOLHANDLE);
-    lua_pushvalue(L, 2);
-    lua_rawget(L, -2);
-    lua_remove(L, -2);
+/* add n (default 1) to integer value of key (missing is 0), return new value */
+static int shincr (lua_State *L) {
+  SharedTable *st = toshared(L, 1);
+  lua_Integer n = luaL_optinteger(L, 3, 1);
+  const char *key;
+  size_t keysize;
+  unsigned long hash;
+  Shard *sh = sh_key(L, st, 2, &key, &keysize, &hash);
+  MUTEX_lock(&sh->mutex);
+  SharedEntry **p = sh_find(sh, key, keysize, hash);
+  SharedEntry *e = (p) ? *p : NULL;
+  SharedValue v;
+  v.isnil = 0;
+  v.isint = 1;
+  v.data = NULL;
+  v.size = 0;
+  if (e && !e->isint) {
+    MUTEX_unlock(&sh->mutex);
+    return luaL_error(L, _("value is not an integer"));
   }
+  v.i = (lua_Integer) ((lua_Unsigned) ((e) ? e->i : 0) + (lua_Unsigned) n);
+  int res = sh_store(sh, p, key, keysize, hash, &v);
+  MUTEX_unlock(&sh->mutex);
+  if (!res)
+    return luaL_error(L, _("not enough memory"));
+  lua_pushinteger(L, v.i);
   return 1;
 }
 
 
-static int pairs_next (lua_State *L) {
-  PoolState *ps = (PoolState *) luaL_checkudata(L, lua_upvalueindex(1), LUA_POOLHANDLE);
-  size_t i = (size_t) luaL_checkinteger(L, lua_upvalueindex(2));
-  if (i < ps->refsize) {
-    lua_pushinteger(L, i + 1);
-    lua_replace(L, lua_upvalueindex(2));
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ps->ref[i]);
+static int shindex (lua_State *L) {
+  luaL_getmetatable(L, LUA_SHAREDHANDLE);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1))  /* method */
     return 1;
+  lua_settop(L, 2);
+  return shget(L);
+}
+
+
+static int shlen (lua_State *L) {
+  SharedTable *st = toshared(L, 1);
+  lua_Integer n = 0;
+  int i;
+  for (i = 0; i < NSHARDS; i++) {
+    MUTEX_lock(&st->shards[i].mutex);
+    n += (lua_Integer) st->shards[i].count;
+    MUTEX_unlock(&st->shards[i].mutex);
   }
-  return 0;
+  lua_pushinteger(L, n);
+  return 1;
 }
 
 
-static int ppairs (lua_State *L) {
-  luaL_checkudata(L, 1, LUA_POOLHANDLE);
-  lua_pushvalue(L, 1);
-  lua_pushinteger(L, 0);
-  lua_pushcclosure(L, pairs_next, 2);
+/*
+** Shared table is serialized by id, so it can be passed to other threads
+*/
+static int shserialize (lua_State *L) {
+  lua_pushinteger(L, shared_serialize(&toshared(L, 1)->obj));
   return 1;
 }
 
 
-static int pwait (lua_State *L) {
-  PoolState *ps = (PoolState *) luaL_checkudata(L, 1, LUA_POOLHANDLE);
-  MUTEX_lock(&ps->mutex);
-  while (ps->nref > 0)
-    COND_wait(&ps->cond, &ps->mutex);
-  MUTEX_unlock(&ps->mutex);
+static int shdeserialize (lua_State *L) {
+  lua_Integer id = luaL_checkinteger(L, 1);
+  SharedTable **box = newshared(L);
+  *box = (SharedTable *) shared_acquire(id);
+  if (*box == NULL)
+    return luaL_error(L, _("shared table is released"));
+  return 1;
+}
+
+
+static int shgc (lua_State *L) {
+  SharedTable **box = (SharedTable **) luaL_checkudata(L, 1, LUA_SHAREDHANDLE);
+  SharedTable *st = *box;
+  *box = NULL;
+  if (st && shared_release(&st->obj))
+    freeshared(st);
   return 0;
 }
 
 
-static int pinterrupt (lua_State *L) {
-  PoolState *ps = (PoolState *) luaL_checkudata(L, 1, LUA_POOLHANDLE);
-  size_t i;
-  for (i = 0; i < ps->refsize; i++) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ps->ref[i]);
-    ThreadState *ts = (ThreadState *) luaL_checkudata(L, -1, LUA_THREADHANDLE);
-    lua_pop(L, 1);
-    MUTEX_lock(&ts->mutex);
-    ts->interrupted = 1;
-    COND_broadcast(&ts->cond);
-    MUTEX_unlock(&ts->mutex);
+static Template ** newtemplate (lua_State *L) {
+  Template **box = (Template **) lua_newuserdata(L, sizeof(Template *));
+  *box = NULL;
+  luaL_setmetatable(L, LUA_TEMPLATEHANDLE);
+  return box;
+}
+
+
+/* resize ready states of template to n at least */
+static void tpl_resize (lua_State *L, Template *tpl, int n) {
+  MUTEX_lock(&tpl->mutex);
+  if (n > tpl->size) {
+    lua_State **states = (lua_State **) realloc(tpl->states, sizeof(lua_State *) * n);
+    if (states == NULL) {
+      MUTEX_unlock(&tpl->mutex);
+      luaL_error(L, _("not enough memory"));
+    }
+    tpl->states = states;
+    tpl->size = n;
   }
-  return 0;
+  MUTEX_unlock(&tpl->mutex);
 }
 
 
-static int pcancel (lua_State *L) {
-  PoolState *ps = (PoolState *) luaL_checkudata(L, 1, LUA_POOLHANDLE);
-  size_t i;
-  for (i = 0; i < ps->refsize; i++) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ps->ref[i]);
-    ThreadState *ts = (ThreadState *) luaL_checkudata(L, -1, LUA_THREADHANDLE);
+/*
+** Create template calling init function f(...) in each state, one state
+** is created at once to check init function
+*/
+static int ttemplate (lua_State *L) {
+  int count = lua_gettop(L);
+  char *var = NULL;
+  size_t varsize = 0;
+  if (count > 0) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_serialize(L, 1, count);
+    const char *s = lua_tolstring(L, -1, &varsize);
+    var = (char *) malloc(sizeof(char) * varsize);
+    if (var == NULL)
+      return luaL_error(L, _("not enough memory"));
+    memcpy(var, s, varsize);
     lua_pop(L, 1);
-    lua_cancel(ts->L);
-    MUTEX_lock(&ts->mutex);
-    COND_broadcast(&ts->cond);
-    MUTEX_unlock(&ts->mutex);
   }
-  return 0;
+  Template **box = newtemplate(L);
+  Template *tpl = (Template *) malloc(sizeof(Template));
+  if (tpl == NULL) {
+    free(var);
+    return luaL_error(L, _("not enough memory"));
+  }
+  MUTEX_init(&tpl->mutex);
+  tpl->var = var;
+  tpl->varsize = varsize;
+  tpl->states = NULL;
+  tpl->nstates = 0;
+  tpl->size = 0;
+  shared_register(&tpl->obj);
+  *box = tpl;
+  tpl_resize(L, tpl, THREAD_ncpu());
+  lua_State *L1 = newstate(tpl, L);
+  if (L1 == NULL)
+    return lua_error(L);
+  tpl_put(tpl, L1);
+  return 1;
 }
 
 
-static int pgc (lua_State *L) {
-  PoolState *ps = (PoolState *) luaL_checkudata(L, 1, LUA_POOLHANDLE);
-  MUTEX_destroy(&ps->mutex);
-  COND_destroy(&ps->cond);
-  if (ps->ref) {
-    size_t i;
-    for (i = 0; i < ps->refsize; i++)
-      luaL_unref(L, LUA_REGISTRYINDEX, ps->ref[i]);
-    free(ps->ref);
+/* call function f(...) in new thread with state of template */
+static int tmnew (lua_State *L) {
+  spawn(L, 2, totemplate(L, 1));
+  return 1;
+}
+
+
+/* create ready states until n (default max number of ready states) */
+static int tmwarm (lua_State *L) {
+  Template *tpl = totemplate(L, 1);
+  int n = (int) luaL_optinteger(L, 2, tpl->size);
+  luaL_argcheck(L, n >= 0, 2, _("number of states must not be negative"));
+  tpl_resize(L, tpl, n);
+  for (;;) {
+    MUTEX_lock(&tpl->mutex);
+    int nstates = tpl->nstates;
+    MUTEX_unlock(&tpl->mutex);
+    if (nstates >= n)
+      break;
+    lua_State *L1 = newstate(tpl, L);
+    if (L1 == NULL)
+      return lua_error(L);
+    if (!tpl_put(tpl, L1)) {
+      lua_close(L1);
+      break;
+    }
   }
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+
+static int tmlen (lua_State *L) {
+  Template *tpl = totemplate(L, 1);
+  MUTEX_lock(&tpl->mutex);
+  int n = tpl->nstates;
+  MUTEX_unlock(&tpl->mutex);
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+
+/*
+** Template is serialized by id, so it can be passed to other threads
+*/
+static int tmserialize (lua_State *L) {
+  lua_pushinteger(L, shared_serialize(&totemplate(L, 1)->obj));
+  return 1;
+}
+
+
+static int tmdeserialize (lua_State *L) {
+  lua_Integer id = luaL_checkinteger(L, 1);
+  Template **box = newtemplate(L);
+  *box = (Template *) shared_acquire(id);
+  if (*box == NULL)
+    return luaL_error(L, _("template is released"));
   return 1;
 }
 
 
+static int tmgc (lua_State *L) {
+  Template **box = (Template **) luaL_checkudata(L, 1, LUA_TEMPLATEHANDLE);
+  Template *tpl = *box;
+  *box = NULL;
+  tpl_release(tpl);
+  return 0;
+}
+
+
+
 /*
 ** functions for 'thread' library
 */
 static const luaL_Reg threadlib[] = {
   {"new", tnew},
   {"pool", tpool},
+  {"channel", tchannel},
+  {"shared", tshared},
+  {"template", ttemplate},
+  {"map", tmap},
+  {"reduce", treduce},
+  {"foreach", tforeach},
+  {"async", tasync},
+  {"dispatch", tdispatch},
+  {"eventfd", teventfd},
   {"join", tjoin},
   {"cancel", tcancel},
+  {"ready", tready},
+  {"wait", twait},
+  {"wait_any", twait_any},
+  {"wait_all", twait_all},
   {"running", trunning},
   {"interrupt", tinterrupt},
   {"interrupted", tinterrupted},
@@ -549,6 +3781,8 @@ static const luaL_Reg threadlib[] = {
 static const luaL_Reg tlib[] = {
   {"join", tjoin},
   {"cancel", tcancel},
+  {"ready", tready},
+  {"wait", twait},
   {"running", trunning},
   {"interrupt", tinterrupt},
   {"interrupted", tinterrupted},
@@ -563,14 +3797,72 @@ static const luaL_Reg plib[] = {
   {"wait", pwait},
   {"interrupt", pinterrupt},
   {"cancel", pcancel},
+  {"stats", pstats},
+  {"after", pafter},
+  {"every", pevery},
   {"__len", plen},
   {"__index", pindex},
   {"__pairs", ppairs},
+  {"__serialize", pserialize},
+  {"__deserialize", pdeserialize},
   {"__gc", pgc},
   {NULL, NULL}
 };
 
 
+static const luaL_Reg chlib[] = {
+  {"push", chpush},
+  {"trypush", chtrypush},
+  {"pop", chpop},
+  {"trypop", chtrypop},
+  {"__len", chlen},
+  {"__serialize", chserialize},
+  {"__deserialize", chdeserialize},
+  {"__gc", chgc},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg shlib[] = {
+  {"get", shget},
+  {"set", shset},
+  {"cas", shcas},
+  {"incr", shincr},
+  {"__index", shindex},
+  {"__newindex", shset},
+  {"__len", shlen},
+  {"__serialize", shserialize},
+  {"__deserialize", shdeserialize},
+  {"__gc", shgc},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg tmlib[] = {
+  {"new", tmnew},
+  {"warm", tmwarm},
+  {"__len", tmlen},
+  {"__serialize", tmserialize},
+  {"__deserialize", tmdeserialize},
+  {"__gc", tmgc},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg aqlib[] = {
+  {"__gc", aqgc},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg tmrlib[] = {
+  {"cancel", tmcancel},
+  {"count", tmcount},
+  {"__gc", tmrgc},
+  {NULL, NULL}
+};
+
+
 static void createmeta (lua_State *L) {
   luaL_newmetatable(L, LUA_THREADHANDLE);  /* create metatable for thread handles */
   lua_pushvalue(L, -1);  /* push metatable */
@@ -582,11 +3874,32 @@ static void createmeta (lua_State *L) {
   lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
   luaL_setfuncs(L, plib, 0);  /* add file methods to new metatable */
   lua_pop(L, 1);  /* pop new metatable */
+  luaL_newmetatable(L, LUA_CHANNELHANDLE);  /* create metatable for channel handles */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, chlib, 0);  /* add file methods to new metatable */
+  lua_pop(L, 1);  /* pop new metatable */
+  luaL_newmetatable(L, LUA_SHAREDHANDLE);  /* create metatable for shared tables */
+  luaL_setfuncs(L, shlib, 0);  /* add methods to new metatable */
+  lua_pop(L, 1);  /* pop new metatable */
+  luaL_newmetatable(L, LUA_TEMPLATEHANDLE);  /* create metatable for templates */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, tmlib, 0);  /* add methods to new metatable */
+  lua_pop(L, 1);  /* pop new metatable */
+  luaL_newmetatable(L, LUA_TIMERHANDLE);  /* create metatable for timer handles */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, tmrlib, 0);  /* add methods to new metatable */
+  lua_pop(L, 1);  /* pop new metatable */
+  luaL_newmetatable(L, LUA_ASYNCHANDLE);  /* create metatable for completion queue */
+  luaL_setfuncs(L, aqlib, 0);
+  lua_pop(L, 1);  /* pop new metatable */
 }
 
 
 static int tcall (lua_State *L) {
-  create(L, 2, NULL);
+  spawn(L, 2, NULL);
   return 1;
 }
 
@@ -605,4 +3918,4 @@ LUAMOD_API int luaopen_thread (lua_State *L) {
   return 1;
 }
 
-#endif
\ No newline at end of file
+#endif
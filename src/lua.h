@@ -484,6 +484,15 @@ LUA_API int   (lua_getside) (lua_State *L);
 /* serialize and deserialize values */
 LUA_API void (lua_serialize) (lua_State *L, int idx, int lastidx);
 LUA_API int (lua_deserialize) (lua_State *L, int idx);
+LUA_API int (lua_deserializebuffer) (lua_State *L, const char *s, size_t l);
+LUA_API void (lua_serializeto) (lua_State *L, int idx, int lastidx, lua_Writer writer, void *ud);
+LUA_API int (lua_deserializefrom) (lua_State *L, lua_Reader reader, void *ud);
+LUA_API void (lua_serializerecords) (lua_State *L, int idx, int fields);
+/* native serializer of userdata copies its data to buf if size is enough and returns size of data,
+   deserializer pushes new userdata of data */
+typedef size_t (*lua_Serializer) (lua_State *L, int idx, void *buf, size_t size);
+typedef void (*lua_Deserializer) (lua_State *L, const void *data, size_t size);
+LUA_API void (lua_setserializer) (lua_State *L, const char *tname, lua_Serializer s, lua_Deserializer d);
 #endif
 
 #ifdef LUAEX_THREADLIB
@@ -815,10 +815,6 @@ void luaV_execute (lua_State *L) {
 #endif
   /* main loop of interpreter */
   for (;;) {
-  #ifdef LUAEX_THREADLIB
-    if (L->canceled)
-      luaG_runerror(L, "canceled");
-  #endif
     Instruction i;
     StkId ra;
     vmfetch();